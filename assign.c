@@ -0,0 +1,113 @@
+/*
+ * Minimum-cost assignment
+ *
+ *
+ * The Hungarian method in its shortest augmenting path form: rows are added
+ * one at a time, each by a Dijkstra-like search over the columns using
+ * reduced costs, for O(n^3) in all.  Rectangular problems are padded out to
+ * square with zero-cost dummies, so a row or column left over simply goes
+ * unassigned.  Everything lives on the stack, sized for ASSIGN_MAX.
+ *
+ * Any column potentials which keep the reduced costs of the rows added so far
+ * non-negative are a valid starting point, and the search makes them so for
+ * each row as it is added.  Starting from the potentials of the last frame's
+ * solution, which are close to optimal for costs that have barely moved, most
+ * rows find a zero-cost column straight away.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "assign.h"
+
+/*
+ * Forgets the potentials, so the next problem starts from scratch
+ */
+void assign_reset(struct assign_state *a)
+{
+	memset(a, 0, sizeof(*a));
+}
+
+/*
+ * Assigns rows to columns at least total cost, given a rows x cols matrix of
+ * costs (row-major).  Stores the column of each row in match, or -1 if it was
+ * left over, and returns the total cost.
+ */
+double assign_solve(struct assign_state *a, const double *cost, int rows,
+		int cols, int *match)
+{
+	int n = rows > cols ? rows : cols;
+	double u[ASSIGN_MAX + 1], minv[ASSIGN_MAX + 1];
+	int p[ASSIGN_MAX + 1], way[ASSIGN_MAX + 1];
+	unsigned char used[ASSIGN_MAX + 1];
+	int i, j;
+
+	if (n > ASSIGN_MAX)
+		return NAN;
+	if (a->size != n) {
+		assign_reset(a);
+		a->size = n;
+	}
+
+	// One-based, with row and column 0 standing for "none"
+	double *v = a->v;
+	memset(u, 0, sizeof(u));
+	memset(p, 0, sizeof(p));
+	for (i = 1; i <= n; i++) {
+		int j0 = 0;
+		p[0] = i;
+		for (j = 0; j <= n; j++) {
+			minv[j] = INFINITY;
+			used[j] = 0;
+		}
+
+		// Grow a tree of tight edges from the new row until it reaches
+		// a free column, then flip the path to it
+		do {
+			int i0 = p[j0], j1 = 0;
+			double delta = INFINITY;
+			used[j0] = 1;
+			for (j = 1; j <= n; j++) {
+				if (used[j])
+					continue;
+				double c = i0 <= rows && j <= cols ?
+					cost[(i0 - 1) * cols + j - 1] : 0;
+				double cur = c - u[i0] - v[j];
+				if (cur < minv[j]) {
+					minv[j] = cur;
+					way[j] = j0;
+				}
+				if (minv[j] < delta) {
+					delta = minv[j];
+					j1 = j;
+				}
+			}
+			for (j = 0; j <= n; j++) {
+				if (used[j]) {
+					u[p[j]] += delta;
+					v[j] -= delta;
+				} else {
+					minv[j] -= delta;
+				}
+			}
+			j0 = j1;
+		} while (p[j0]);
+
+		do {
+			int j1 = way[j0];
+			p[j0] = p[j1];
+			j0 = j1;
+		} while (j0);
+	}
+
+	double total = 0;
+	for (i = 0; i < rows; i++)
+		match[i] = -1;
+	for (j = 1; j <= cols; j++) {
+		if (p[j] && p[j] <= rows) {
+			match[p[j] - 1] = j - 1;
+			total += cost[(p[j] - 1) * cols + j - 1];
+		}
+	}
+	return total;
+}
@@ -0,0 +1,20 @@
+#ifndef ASSIGN_H_
+#define ASSIGN_H_
+
+// Most rows or columns of an assignment problem
+#define ASSIGN_MAX 10
+
+/*
+ * Dual potentials of the columns from the last problem solved, which the next
+ * one of the same size starts from
+ */
+struct assign_state {
+	int size;
+	double v[ASSIGN_MAX + 1];
+};
+
+void assign_reset(struct assign_state *a);
+double assign_solve(struct assign_state *a, const double *cost, int rows,
+		int cols, int *match);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * Per-user calibration of chord templates
+ *
+ *
+ * Every chord recognised is folded into a running mean and covariance of the
+ * descriptions made for it, at a fixed cost per chord.  Once a chord has been
+ * seen often enough its mean takes the template's place in the
+ * nearest-neighbour index, so matching follows the shape of the user's hand
+ * rather than the hand model.  Descriptions far outside a chord's spread so
+ * far are left out, so a misrecognised chord doesn't drag it away.
+ *
+ * The index is rebuilt from a snapshot of the means on a thread of its own,
+ * and picked up by the event loop whenever a new one is ready.  The model is
+ * saved as a header and an array of fixed-size entries, which loads with a
+ * single read.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "calib.h"
+
+#define CALIB_MAGIC 0x62696c63
+#define CALIB_VERSION 1
+
+// Chords seen fewer times than this are matched against their template
+#define CALIB_MIN_SAMPLES 8
+
+// Descriptions further than CALIB_GATE standard deviations from the mean in
+// any coordinate are not learned from.  The deviation is taken to be at least
+// CALIB_MIN_STDDEV, in multiples of the scale, so that a chord can still
+// drift.
+#define CALIB_GATE 3.0f
+#define CALIB_MIN_STDDEV 0.25f
+
+struct calib {
+	struct calib_header *hdr;
+	struct calib_entry *entries;
+	struct chord_desc *base;
+	int n;
+
+	// Rebuilding the index: descriptions to build it from, handed over
+	// when requested, and the index once it is built.  Busy from the
+	// request until the index has been taken.
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+	int running;
+	struct chord_desc *snapshot;
+	int requested;
+	int busy;
+	int shutdown;
+	struct chord_index built;
+	int ready;
+};
+
+/*
+ * Returns the position of a covariance entry in the packed upper triangle
+ */
+static int calib_cov_index(int i, int j, int dims)
+{
+	return i * dims - i * (i - 1) / 2 + (j - i);
+}
+
+/*
+ * Folds bytes into an FNV-1a hash
+ */
+static uint64_t calib_hash(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+/*
+ * Identifies a layout by its template descriptions.  Only the coordinates a
+ * description uses are hashed, since the rest are never written.
+ */
+static uint64_t calib_fingerprint(const struct chord_desc *base, int n)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		h = calib_hash(h, &base[i].n, sizeof(base[i].n));
+		h = calib_hash(h, base[i].v, 2 * base[i].n * sizeof(base[i].v[0]));
+	}
+	return h;
+}
+
+/*
+ * Description to index a chord by: its mean once it has been seen often
+ * enough, or its template
+ */
+static void calib_current(const struct calib *c, int t, struct chord_desc *d)
+{
+	const struct calib_entry *e = &c->entries[t];
+
+	*d = c->base[t];
+	if (e->count < CALIB_MIN_SAMPLES || (int) e->n != d->n)
+		return;
+	memcpy(d->v, e->mean, 2 * d->n * sizeof(d->v[0]));
+}
+
+static void *calib_main(void *arg)
+{
+	struct calib *c = arg;
+	struct chord_index ix;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (!c->shutdown && !c->requested)
+			pthread_cond_wait(&c->wake, &c->lock);
+		if (c->shutdown)
+			break;
+		c->requested = 0;
+
+		// The snapshot isn't touched again until the index built from
+		// it has been taken
+		pthread_mutex_unlock(&c->lock);
+		int ret = chord_index_build(&ix, c->snapshot, c->n);
+		pthread_mutex_lock(&c->lock);
+		if (ret) {
+			c->busy = 0;
+		} else {
+			c->built = ix;
+			c->ready = 1;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+/*
+ * Starts calibrating the chords with the given template descriptions
+ */
+struct calib *calib_create(const struct chord_desc *base, int n)
+{
+	struct calib *c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->n = n;
+	c->hdr = calloc(1, sizeof(*c->hdr) + n * sizeof(c->entries[0]));
+	c->base = malloc(n * sizeof(c->base[0]));
+	c->snapshot = malloc(n * sizeof(c->snapshot[0]));
+	if (!c->hdr || (n && (!c->base || !c->snapshot))) {
+		calib_destroy(c);
+		return NULL;
+	}
+	memcpy(c->base, base, n * sizeof(c->base[0]));
+
+	// Entries follow the header, just as in the file
+	c->entries = (struct calib_entry *) (c->hdr + 1);
+	c->hdr->magic = CALIB_MAGIC;
+	c->hdr->version = CALIB_VERSION;
+	c->hdr->nchords = n;
+	c->hdr->layout = calib_fingerprint(base, n);
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->wake, NULL);
+	if (pthread_create(&c->thread, NULL, calib_main, c)) {
+		fprintf(stderr, "Failed to start calibration thread\n");
+		calib_destroy(c);
+		return NULL;
+	}
+	c->running = 1;
+	return c;
+}
+
+/*
+ * Stops the rebuilding thread and frees the model
+ */
+void calib_destroy(struct calib *c)
+{
+	if (!c)
+		return;
+
+	if (c->running) {
+		pthread_mutex_lock(&c->lock);
+		c->shutdown = 1;
+		pthread_cond_signal(&c->wake);
+		pthread_mutex_unlock(&c->lock);
+		pthread_join(c->thread, NULL);
+		pthread_cond_destroy(&c->wake);
+		pthread_mutex_destroy(&c->lock);
+	}
+	if (c->ready)
+		chord_index_free(&c->built);
+
+	free(c->snapshot);
+	free(c->base);
+	free(c->hdr);
+	free(c);
+}
+
+/*
+ * Replaces the model with one saved earlier.  A missing file leaves it empty;
+ * one learned for a different layout is ignored.  Returns nonzero if the file
+ * couldn't be read.
+ */
+int calib_load(struct calib *c, const char *path)
+{
+	size_t size = sizeof(*c->hdr) + c->n * sizeof(c->entries[0]);
+	struct calib_header hdr;
+	struct stat st;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	// Check the header first so as not to clobber the model with the
+	// wrong layout's
+	int ret = 0;
+	if (fstat(fd, &st) || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "Can't read %s: %s\n", path, strerror(errno));
+		ret = 1;
+	} else if (hdr.magic != CALIB_MAGIC || hdr.version != CALIB_VERSION ||
+			hdr.nchords != c->hdr->nchords ||
+			hdr.layout != c->hdr->layout ||
+			(size_t) st.st_size != size) {
+		fprintf(stderr, "%s was learned for another layout, "
+				"starting afresh\n", path);
+	} else if (read(fd, c->entries, size - sizeof(hdr)) !=
+			(ssize_t) (size - sizeof(hdr))) {
+		fprintf(stderr, "Can't read %s\n", path);
+		memset(c->entries, 0, size - sizeof(hdr));
+		ret = 1;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Writes the model to a file, replacing any old one in a single step
+ */
+int calib_save(const struct calib *c, const char *path)
+{
+	size_t size = sizeof(*c->hdr) + c->n * sizeof(c->entries[0]);
+
+	char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+	if (!tmp)
+		return 1;
+	sprintf(tmp, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "wb");
+	int ret = !f || fwrite(c->hdr, 1, size, f) != size;
+	if (f && fclose(f))
+		ret = 1;
+	if (!ret && rename(tmp, path))
+		ret = 1;
+	if (ret) {
+		fprintf(stderr, "Can't save calibration in %s: %s\n", path,
+				strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Learns from a description a chord was recognised from.  Returns 1 if it was
+ * taken into the model, or 0 if it was too far out.
+ */
+int calib_add(struct calib *c, int t, const struct chord_desc *d)
+{
+	struct calib_entry *e = &c->entries[t];
+	int dims = 2 * d->n;
+	float delta[2 * CHORD_MAX_FINGERS];
+	int i, j;
+
+	if (d->n != c->base[t].n)
+		return 0;
+
+	if (e->count >= CALIB_MIN_SAMPLES) {
+		for (i = 0; i < dims; i++) {
+			float var = e->m2[calib_cov_index(i, i, dims)] /
+				(e->count - 1);
+			float sd = sqrtf(var);
+			if (sd < CALIB_MIN_STDDEV)
+				sd = CALIB_MIN_STDDEV;
+			if (fabsf(d->v[i] - e->mean[i]) > CALIB_GATE * sd)
+				return 0;
+		}
+	}
+
+	e->n = d->n;
+	e->count++;
+	for (i = 0; i < dims; i++) {
+		delta[i] = d->v[i] - e->mean[i];
+		e->mean[i] += delta[i] / e->count;
+	}
+	for (i = 0; i < dims; i++)
+		for (j = i; j < dims; j++)
+			e->m2[calib_cov_index(i, j, dims)] +=
+				delta[i] * (d->v[j] - e->mean[j]);
+	return 1;
+}
+
+/*
+ * Starts rebuilding the index from the model as it stands.  Returns nonzero,
+ * doing nothing, if the last rebuild hasn't been picked up yet.
+ */
+int calib_rebuild(struct calib *c)
+{
+	int t;
+
+	pthread_mutex_lock(&c->lock);
+	int busy = c->busy;
+	pthread_mutex_unlock(&c->lock);
+	if (busy)
+		return 1;
+
+	for (t = 0; t < c->n; t++)
+		calib_current(c, t, &c->snapshot[t]);
+
+	pthread_mutex_lock(&c->lock);
+	c->requested = 1;
+	c->busy = 1;
+	pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+/*
+ * Swaps in a rebuilt index, if one is ready, freeing the old one.  Returns 1
+ * if it did.
+ */
+int calib_take(struct calib *c, struct chord_index *ix)
+{
+	pthread_mutex_lock(&c->lock);
+	int ready = c->ready;
+	if (ready) {
+		chord_index_free(ix);
+		*ix = c->built;
+		c->ready = 0;
+		c->busy = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return ready;
+}
@@ -0,0 +1,47 @@
+#ifndef CALIB_H_
+#define CALIB_H_
+
+#include <stdint.h>
+
+#include "chord.h"
+
+// Entries of the packed upper triangle of a description's covariance
+#define CALIB_COV (CHORD_MAX_FINGERS * (2 * CHORD_MAX_FINGERS + 1))
+
+/*
+ * Header of a calibration file, followed by one entry for each chord of the
+ * layout it was learned for
+ */
+struct calib_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nchords;
+	uint32_t reserved;
+	uint64_t layout;
+};
+
+/*
+ * Running mean of the descriptions a chord has been recognised from, and the
+ * sums of products of their deviations from it (Welford's method), from which
+ * the covariance follows
+ */
+struct calib_entry {
+	uint32_t count;
+	uint32_t n;
+	float mean[2 * CHORD_MAX_FINGERS];
+	float m2[CALIB_COV];
+};
+
+struct calib;
+
+struct calib *calib_create(const struct chord_desc *base, int n);
+void calib_destroy(struct calib *c);
+
+int calib_load(struct calib *c, const char *path);
+int calib_save(const struct calib *c, const char *path);
+
+int calib_add(struct calib *c, int t, const struct chord_desc *d);
+int calib_rebuild(struct calib *c);
+int calib_take(struct calib *c, struct chord_index *ix);
+
+#endif
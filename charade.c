@@ -4,113 +4,780 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <math.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
-#include <X11/extensions/XInput2.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/XKBlib.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xinput.h>
+#include <xcb/shape.h>
+#include <xcb/composite.h>
+#include <xcb/xtest.h>
 #ifdef XFT_TEXT
 #include <X11/Xft/Xft.h>
 #endif
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "charade.h"
+#include "workers.h"
+
+// Axis labels assigned by the evdev and libinput drivers
+static const char *const valuator_labels[NVALUATORS] = {
+	[VAL_PRESSURE] = "Abs MT Pressure",
+	[VAL_TOUCH_MAJOR] = "Abs MT Touch Major",
+	[VAL_TOUCH_MINOR] = "Abs MT Touch Minor",
+	[VAL_ORIENTATION] = "Abs MT Orientation",
+};
+
+static const struct point chord_anchors[CHORD_MAX_FINGERS] = CHORD_ANCHORS;
+static const struct chord_template default_layout[] = CHORD_LAYOUT;
+static const char *const softkey_rows[] = SOFTKEY_ROWS;
+
+// Cluster analysis results, as reported on exit
+static const char *const result_names[NRESULTS] = {
+	[RESULT_HULL] = "hull",
+	[RESULT_AREA] = "area",
+	[RESULT_BBOX] = "bounding box",
+	[RESULT_CENTER] = "centre",
+	[RESULT_FINGERS] = "fingers",
+};
+
+static const char *const path_names[NPATHS] = {
+	[PATH_DIRECT] = "direct",
+	[PATH_COMPOSITED] = "composited",
+	[PATH_OVERLAY] = "overlay",
+};
+
+static const char *const phase_names[NPHASES] = {
+	[PHASE_LAYOUT] = "layout",
+	[PHASE_DISPLAY] = "display",
+	[PHASE_DEVICES] = "devices",
+	[PHASE_WINDOW] = "window",
+	[PHASE_DRAW] = "drawing",
+	[PHASE_FONT_WAIT] = "font wait",
+	[PHASE_FIRST_FRAME] = "first frame",
+};
 
+/*
+ * Converts an XInput 16.16 fixed-point value to a double
+ */
+static double fp1616_to_double(xcb_input_fp1616_t v)
+{
+	return v / 65536.0;
+}
 
 /*
- * Searches the input hierarchy for a direct-touch device (e.g. a touchscreen,
- * but not most touchpads).  The id parameter gives either a specific device ID
- * to check or one of the special values XIAllDevices or XIAllMasterDevices.
+ * Converts an XInput 32.32 fixed-point value to a double
  */
-static int init_touch_device(struct kbd_state *state, int id)
+static double fp3232_to_double(xcb_input_fp3232_t v)
 {
-	// Get list of input devices and parameters
-	XIDeviceInfo *di;
-	int ndev;
-	di = XIQueryDevice(state->dpy, id, &ndev);
-	if (!di) {
-		fprintf(stderr, "Failed to query devices\n");
+	return v.integral + v.frac / 4294967296.0;
+}
+
+/*
+ * Allocates (or reallocates) the touch table and analysis buffers of a touch
+ * device for the given number of slots.  Touches beyond the new size are
+ * dropped.  On failure the device is left as it was.
+ */
+static int resize_touch_device(struct touch_device *dev, int nslots)
+{
+	// Keeping track of currently held touches and the corresponding
+	// XInput touch event IDs, plus scratch space so the analysis never has
+	// to allocate
+	struct point *touchpts = malloc(nslots * sizeof(touchpts[0]));
+	int *touchids = malloc(nslots * sizeof(touchids[0]));
+	struct touch_attrs *touchattrs = malloc(nslots * sizeof(touchattrs[0]));
+	struct touch_track *touchtrack = malloc(nslots * sizeof(touchtrack[0]));
+	struct touch_history *histpool = calloc(nslots, sizeof(histpool[0]));
+	struct touch_history **touchhist = malloc(nslots * sizeof(touchhist[0]));
+	struct touch_cluster *clusters = malloc(nslots * sizeof(clusters[0]));
+	struct point *clbuf = malloc(2 * nslots * nslots * sizeof(clbuf[0]));
+	int *clidx = malloc(3 * nslots * nslots * sizeof(clidx[0]));
+	int *groups = malloc(3 * nslots * sizeof(groups[0]));
+	struct point *work = malloc(3 * nslots * sizeof(work[0]));
+
+	if (!touchpts || !touchids || !touchattrs || !touchtrack ||
+			!histpool || !touchhist || !clusters || !clbuf ||
+			!clidx || !groups || !work) {
+		free(work);
+		free(groups);
+		free(clidx);
+		free(clbuf);
+		free(clusters);
+		free(touchhist);
+		free(histpool);
+		free(touchtrack);
+		free(touchattrs);
+		free(touchids);
+		free(touchpts);
 		return 1;
 	}
 
-	// Find the first direct-touch device
+	// Each slot owns one ring for its whole life, so nothing is allocated
+	// as touches come and go
 	int i;
-	for (i = 0; i < ndev; i++) {
-		int j;
-		for (j = 0; j < di[i].num_classes; j++) {
-			XITouchClassInfo *tci =
-				(XITouchClassInfo *) di[i].classes[j];
-			if (tci->type == XITouchClass &&
-					tci->mode == XIDirectTouch) {
-				state->input_dev = di[i].deviceid;
-				state->nslots = tci->num_touches;
-				goto done;
-			}
-		}
+	for (i = 0; i < nslots; i++)
+		touchhist[i] = &histpool[i];
+
+	// Likewise each cluster owns room for a whole device's worth of points
+	// and hull.  The clusters themselves are rebuilt by the next analysis.
+	for (i = 0; i < nslots; i++) {
+		clusters[i].pts = clbuf + 2 * i * nslots;
+		clusters[i].hull = clbuf + (2 * i + 1) * nslots;
+		clusters[i].members = clidx + 3 * i * nslots;
+		clusters[i].hullids = clidx + (3 * i + 1) * nslots;
+		clusters[i].order = clidx + (3 * i + 2) * nslots;
 	}
 
-done:
-	XIFreeDeviceInfo(di);
-	if (i >= ndev) {
-		fprintf(stderr, "No touch device found\n");
-		return 1;
+	if (dev->touches > nslots)
+		dev->touches = nslots;
+	for (i = 0; i < dev->touches; i++)
+		histpool[i] = *dev->touchhist[i];
+	if (dev->touches) {
+		memcpy(touchpts, dev->touchpts,
+				dev->touches * sizeof(touchpts[0]));
+		memcpy(touchids, dev->touchids,
+				dev->touches * sizeof(touchids[0]));
+		memcpy(touchattrs, dev->touchattrs,
+				dev->touches * sizeof(touchattrs[0]));
+		memcpy(touchtrack, dev->touchtrack,
+				dev->touches * sizeof(touchtrack[0]));
+	}
+
+	free(dev->work);
+	free(dev->groups);
+	free(dev->clidx);
+	free(dev->clbuf);
+	free(dev->clusters);
+	free(dev->touchhist);
+	free(dev->histpool);
+	free(dev->touchtrack);
+	free(dev->touchattrs);
+	free(dev->touchids);
+	free(dev->touchpts);
+
+	dev->touchpts = touchpts;
+	dev->touchids = touchids;
+	dev->touchattrs = touchattrs;
+	dev->touchtrack = touchtrack;
+	dev->histpool = histpool;
+	dev->touchhist = touchhist;
+	dev->clusters = clusters;
+	dev->nclusters = 0;
+	dev->clbuf = clbuf;
+	dev->clidx = clidx;
+	dev->groups = groups;
+	dev->work = work;
+	dev->nslots = nslots;
+	dev->dirty = 1;
+	return 0;
+}
+
+/*
+ * Allocates the touch table and analysis buffers for one touch device
+ */
+static struct touch_device *create_touch_device(int deviceid, int nslots)
+{
+	struct touch_device *dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->deviceid = deviceid;
+	if (resize_touch_device(dev, nslots)) {
+		free(dev);
+		return NULL;
 	}
 
-	// Allocate space for keeping track of currently held touches and the
-	// corresponding XInput touch event IDs
-	state->touchpts = malloc(state->nslots * sizeof(state->touchpts[0]));
-	state->touchids = malloc(state->nslots * sizeof(state->touchids[0]));
+	// Touch list is empty to start
+	dev->touches = 0;
+	dev->chord.settle = -1;
+	dev->chord.abort = -1;
+	dev->chord.last = -1;
+	dev->lastkey = -1;
+
+	return dev;
+}
+
+/*
+ * Frees everything allocated by create_touch_device
+ */
+static void free_touch_device(struct touch_device *dev)
+{
+	free(dev->work);
+	free(dev->groups);
+	free(dev->clidx);
+	free(dev->clbuf);
+	free(dev->clusters);
+	free(dev->touchhist);
+	free(dev->histpool);
+	free(dev->touchtrack);
+	free(dev->touchattrs);
+	free(dev->touchids);
+	free(dev->touchpts);
+	free(dev);
+}
+
+/*
+ * Makes sure the shared drawing buffers can hold a device with the given
+ * number of slots
+ */
+static int ensure_draw_buffers(struct kbd_state *state, int nslots)
+{
+	if (nslots <= state->maxslots)
+		return 0;
+
+	xcb_arc_t *arcs = realloc(state->arcs, nslots * sizeof(arcs[0]));
+	if (!arcs)
+		return 1;
+	state->arcs = arcs;
+
+	xcb_point_t *lines = realloc(state->lines,
+			(nslots + 1) * sizeof(lines[0]));
+	if (!lines)
+		return 1;
+	state->lines = lines;
+
+	xcb_rectangle_t *rects = realloc(state->rects,
+			nslots * sizeof(rects[0]));
+	if (!rects)
+		return 1;
+	state->rects = rects;
+
+	state->maxslots = nslots;
+	return 0;
+}
+
+/*
+ * Starts tracking a touch device
+ */
+static struct touch_device *add_touch_device(struct kbd_state *state,
+		int deviceid, int nslots)
+{
+	if (deviceid >= MAX_DEVICES || state->devs[deviceid]) {
+		fprintf(stderr, "Can't track device %d\n", deviceid);
+		return NULL;
+	}
 
-	if (!state->touchpts || !state->touchids) {
+	struct touch_device *dev = NULL;
+	if (ensure_draw_buffers(state, nslots) ||
+			!(dev = create_touch_device(deviceid, nslots))) {
 		fprintf(stderr, "Failed to allocate touches/ids\n");
-		free(state->touchids);
-		free(state->touchpts);
+		return NULL;
+	}
+
+	dev->anchors = state->layout.anchors;
+	state->devs[deviceid] = dev;
+	state->devlist[state->ndevs++] = dev;
+	return dev;
+}
+
+/*
+ * Stops tracking a touch device, forgetting any touches it still had
+ */
+static void remove_touch_device(struct kbd_state *state,
+		struct touch_device *dev)
+{
+	int i;
+	for (i = 0; i < state->ndevs; i++)
+		if (state->devlist[i] == dev)
+			break;
+	assert(i < state->ndevs);
+
+	state->devlist[i] = state->devlist[--state->ndevs];
+	state->devs[dev->deviceid] = NULL;
+
+	// Nothing is left for the device's timers to act on
+	timers_cancel(state->timers, dev->chord.settle);
+	timers_cancel(state->timers, dev->chord.abort);
+	for (i = 0; i < dev->touches; i++)
+		timers_cancel(state->timers, dev->touchtrack[i].timer);
+
+	free_touch_device(dev);
+	state->dirty = 1;
+}
+
+/*
+ * Returns the number of touch slots if the given device classes include
+ * direct touch, or 0 otherwise
+ */
+static int direct_touch_slots(xcb_input_device_class_iterator_t ci)
+{
+	for (; ci.rem; xcb_input_device_class_next(&ci)) {
+		xcb_input_touch_class_t *tci =
+			(xcb_input_touch_class_t *) ci.data;
+		if (tci->type == XCB_INPUT_DEVICE_CLASS_TYPE_TOUCH &&
+				tci->mode == XCB_INPUT_TOUCH_MODE_DIRECT)
+			return tci->num_touches;
+	}
+	return 0;
+}
+
+/*
+ * Finds the valuators we decode among a device's classes and precomputes
+ * where each one's bit sits in an event's valuator mask.  X and Y are always
+ * valuators 0 and 1; the rest are identified by their label atoms.
+ */
+static void plan_valuators(struct kbd_state *state, struct touch_device *dev,
+		xcb_input_device_class_iterator_t ci)
+{
+	int i, j;
+
+	for (i = 0; i < NVALUATORS; i++)
+		dev->vals[i].number = -1;
+
+	for (; ci.rem; xcb_input_device_class_next(&ci)) {
+		xcb_input_valuator_class_t *vci =
+			(xcb_input_valuator_class_t *) ci.data;
+		if (vci->type != XCB_INPUT_DEVICE_CLASS_TYPE_VALUATOR)
+			continue;
+
+		if (vci->number == 0)
+			i = VAL_X;
+		else if (vci->number == 1)
+			i = VAL_Y;
+		else
+			for (i = VAL_Y + 1; i < NVALUATORS; i++)
+				if (state->val_labels[i] != XCB_NONE &&
+						vci->label == state->val_labels[i])
+					break;
+		if (i == NVALUATORS)
+			continue;
+
+		struct valuator *v = &dev->vals[i];
+		v->number = vci->number;
+		v->word = vci->number / 32;
+		v->bit = 1u << vci->number % 32;
+		v->below = v->bit - 1;
+		v->min = fp3232_to_double(vci->min);
+		v->max = fp3232_to_double(vci->max);
+	}
+
+	// Decode in valuator order so the packed values are walked only once
+	dev->nplan = 0;
+	for (i = 0; i < NVALUATORS; i++) {
+		if (dev->vals[i].number < 0)
+			continue;
+		for (j = dev->nplan; j > 0 &&
+				dev->vals[dev->plan[j - 1]].number >
+				dev->vals[i].number; j--)
+			dev->plan[j] = dev->plan[j - 1];
+		dev->plan[j] = i;
+		dev->nplan++;
+	}
+}
+
+/*
+ * Charges the time since the last mark to a phase of startup
+ */
+static void mark_phase(struct kbd_state *state, int phase)
+{
+	uint64_t now = latency_now();
+	state->phases[phase] += now - state->phase_mark;
+	state->phase_mark = now;
+}
+
+/*
+ * Looks up the label atoms of the valuators identified by label, sending all
+ * of the requests before waiting on any reply
+ */
+static void intern_valuator_labels(struct kbd_state *state)
+{
+	xcb_intern_atom_cookie_t cookies[NVALUATORS];
+	int i;
+
+	for (i = 0; i < NVALUATORS; i++) {
+		if (!valuator_labels[i])
+			continue;
+		cookies[i] = xcb_intern_atom(state->conn, 1,
+				strlen(valuator_labels[i]), valuator_labels[i]);
+	}
+	for (i = 0; i < NVALUATORS; i++) {
+		state->val_labels[i] = XCB_NONE;
+		if (!valuator_labels[i])
+			continue;
+		xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(
+				state->conn, cookies[i], NULL);
+		if (reply)
+			state->val_labels[i] = reply->atom;
+		free(reply);
+	}
+}
+
+/*
+ * Starts tracking the device described by a query reply entry if it is a
+ * direct-touch device (e.g. a touchscreen, but not most touchpads) and
+ * matches the device selection given on the command line
+ */
+static struct touch_device *track_device_info(struct kbd_state *state,
+		xcb_input_xi_device_info_t *info)
+{
+	// Master devices mirror the classes of their last-used slave, so only
+	// look at those if asked to
+	switch (state->device_filter) {
+		case XCB_INPUT_DEVICE_ALL:
+			if (info->type == XCB_INPUT_DEVICE_TYPE_MASTER_POINTER ||
+					info->type == XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD)
+				return NULL;
+			break;
+		case XCB_INPUT_DEVICE_ALL_MASTER:
+			break;
+		default:
+			if (info->deviceid != state->device_filter)
+				return NULL;
+			break;
+	}
+
+	int nslots = direct_touch_slots(
+			xcb_input_xi_device_info_classes_iterator(info));
+	if (!nslots)
+		return NULL;
+
+	struct touch_device *dev = add_touch_device(state, info->deviceid,
+			nslots);
+	if (dev)
+		plan_valuators(state, dev,
+				xcb_input_xi_device_info_classes_iterator(info));
+	return dev;
+}
+
+/*
+ * Asks for the input devices and their parameters.  The id parameter gives
+ * either a specific device ID to check or one of the special values
+ * XCB_INPUT_DEVICE_ALL or XCB_INPUT_DEVICE_ALL_MASTER.
+ */
+static xcb_input_xi_query_device_cookie_t query_touch_devices(
+		struct kbd_state *state, int id)
+{
+	state->device_filter = id;
+	return xcb_input_xi_query_device(state->conn, id);
+}
+
+/*
+ * Searches the reply to query_touch_devices for direct-touch devices and
+ * tracks each one found
+ */
+static int init_touch_devices(struct kbd_state *state,
+		xcb_input_xi_query_device_cookie_t cookie)
+{
+	xcb_input_xi_query_device_reply_t *reply;
+	reply = xcb_input_xi_query_device_reply(state->conn, cookie, NULL);
+	if (!reply) {
+		fprintf(stderr, "Failed to query devices\n");
 		return 1;
 	}
 
-	// Touch list is empty to start
-	state->touches = 0;
+	// Find every direct-touch device
+	xcb_input_xi_device_info_iterator_t di;
+	for (di = xcb_input_xi_query_device_infos_iterator(reply);
+			di.rem; xcb_input_xi_device_info_next(&di))
+		track_device_info(state, di.data);
+
+	free(reply);
+	if (!state->ndevs) {
+		fprintf(stderr, "No touch device found\n");
+		return 1;
+	}
 
 	return 0;
 }
 
 /*
- * Clean up resources allocated for touch device
+ * Clean up resources allocated for touch devices
  */
-static void destroy_touch_device(struct kbd_state *state)
+static void destroy_touch_devices(struct kbd_state *state)
 {
-	free(state->touchids);
-	free(state->touchpts);
+	int i;
+	for (i = 0; i < state->ndevs; i++)
+		free_touch_device(state->devlist[i]);
+	free(state->rects);
+	free(state->lines);
+	free(state->arcs);
 }
 
 /*
- * Establishes an active grab on the touch device
+ * Requests an active grab on the touch device.  The reply is collected
+ * separately by grab_touches_reply so other setup can go out in the meantime.
  */
-static int grab_touches(struct kbd_state *state)
+static xcb_input_xi_grab_device_cookie_t grab_touches(struct kbd_state *state,
+		struct touch_device *dev)
 {
 	// Set up event mask for touch events
-	unsigned char mask[XIMaskLen(XI_LASTEVENT)];
-	memset(mask, 0, sizeof(mask));
-	XISetMask(mask, XI_TouchBegin);
-	XISetMask(mask, XI_TouchUpdate);
-	XISetMask(mask, XI_TouchEnd);
-
-	XIEventMask em = {
-		.mask = mask,
-		.mask_len = sizeof(mask),
-		.deviceid = state->input_dev,
-	};
+	uint32_t mask = XCB_INPUT_XI_EVENT_MASK_TOUCH_BEGIN |
+		XCB_INPUT_XI_EVENT_MASK_TOUCH_UPDATE |
+		XCB_INPUT_XI_EVENT_MASK_TOUCH_END;
 
 	// Grab the touch device
-	return XIGrabDevice(state->dpy, state->input_dev,
-			DefaultRootWindow(state->dpy), CurrentTime, None,
-			XIGrabModeAsync, XIGrabModeAsync, False, &em);
+	return xcb_input_xi_grab_device(state->conn, state->root,
+			XCB_CURRENT_TIME, XCB_NONE, dev->deviceid,
+			XCB_INPUT_GRAB_MODE_22_ASYNC, XCB_INPUT_GRAB_MODE_22_ASYNC,
+			XCB_INPUT_GRAB_OWNER_NO_OWNER, 1, &mask);
+}
+
+/*
+ * Waits for the result of a grab_touches request
+ */
+static int grab_touches_reply(struct kbd_state *state,
+		xcb_input_xi_grab_device_cookie_t cookie)
+{
+	xcb_input_xi_grab_device_reply_t *reply;
+	int ret;
+
+	reply = xcb_input_xi_grab_device_reply(state->conn, cookie, NULL);
+	ret = !reply || reply->status != XCB_GRAB_STATUS_SUCCESS;
+	free(reply);
+	return ret;
+}
+
+/*
+ * Releases grab for a touch device
+ */
+static void ungrab_touches(struct kbd_state *state, struct touch_device *dev)
+{
+	xcb_input_xi_ungrab_device(state->conn, XCB_CURRENT_TIME,
+			dev->deviceid);
+}
+
+/*
+ * Grabs every tracked touch device, sending all of the requests before
+ * waiting on any of the replies
+ */
+static int grab_all_touches(struct kbd_state *state)
+{
+	xcb_input_xi_grab_device_cookie_t grabs[MAX_DEVICES];
+	int i, ret = 0;
+
+	for (i = 0; i < state->ndevs; i++)
+		grabs[i] = grab_touches(state, state->devlist[i]);
+	for (i = 0; i < state->ndevs; i++)
+		if (grab_touches_reply(state, grabs[i]))
+			ret = 1;
+
+	return ret;
+}
+
+/*
+ * Releases grabs for all touch devices
+ */
+static void ungrab_all_touches(struct kbd_state *state)
+{
+	int i;
+	for (i = 0; i < state->ndevs; i++)
+		ungrab_touches(state, state->devlist[i]);
+}
+
+/*
+ * Looks up the state for a tracked device, or returns NULL if the device is
+ * not being tracked
+ */
+static struct touch_device *find_device(struct kbd_state *state, int deviceid)
+{
+	if (deviceid < 0 || deviceid >= MAX_DEVICES)
+		return NULL;
+	return state->devs[deviceid];
+}
+
+static void handle_reply(struct kbd_state *state,
+		const struct pending_reply *p, void *reply);
+
+/*
+ * Remembers a request whose reply will be handled from the event loop rather
+ * than waited for
+ */
+static void add_pending(struct kbd_state *state, int type, int deviceid,
+		unsigned int sequence)
+{
+	// Out of room, so block on the oldest one to make some.  It comes off
+	// the queue first, since handling it may add more.
+	while (state->npending == MAX_PENDING) {
+		struct pending_reply p = state->pending[0];
+		memmove(&state->pending[0], &state->pending[1],
+				--state->npending * sizeof(state->pending[0]));
+
+		xcb_generic_error_t *err = NULL;
+		void *reply = xcb_wait_for_reply(state->conn, p.sequence, &err);
+		handle_reply(state, &p, reply);
+		free(reply);
+		free(err);
+	}
+
+	state->pending[state->npending++] = (struct pending_reply) {
+		.sequence = sequence,
+		.type = type,
+		.deviceid = deviceid,
+	};
+}
+
+/*
+ * Handles any outstanding replies which have arrived, without blocking, and
+ * returns how many there were
+ */
+static int poll_pending(struct kbd_state *state)
+{
+	int i = 0, handled = 0;
+	while (i < state->npending) {
+		xcb_generic_error_t *err = NULL;
+		void *reply = NULL;
+		if (!xcb_poll_for_reply(state->conn, state->pending[i].sequence,
+					&reply, &err)) {
+			i++;
+			continue;
+		}
+
+		// Copy it out first, since handling it may add more
+		struct pending_reply p = state->pending[i];
+		memmove(&state->pending[i], &state->pending[i + 1],
+				(--state->npending - i) * sizeof(state->pending[0]));
+		handle_reply(state, &p, reply);
+		free(reply);
+		free(err);
+		handled++;
+	}
+	return handled;
+}
+
+/*
+ * Selects for changes to the input device hierarchy so devices can come and
+ * go while running, plus the raw touch stream when observing passively
+ */
+static void select_device_events(struct kbd_state *state)
+{
+	struct {
+		xcb_input_event_mask_t head;
+		uint32_t mask;
+	} em = {
+		.head = {
+			.deviceid = XCB_INPUT_DEVICE_ALL,
+			.mask_len = 1,
+		},
+		.mask = XCB_INPUT_XI_EVENT_MASK_HIERARCHY |
+			XCB_INPUT_XI_EVENT_MASK_DEVICE_CHANGED,
+	};
+
+	// Raw events are delivered regardless of grabs, and selecting them
+	// doesn't change what anyone else receives
+	if (state->passive)
+		em.mask |= XCB_INPUT_XI_EVENT_MASK_RAW_TOUCH_BEGIN |
+			XCB_INPUT_XI_EVENT_MASK_RAW_TOUCH_UPDATE |
+			XCB_INPUT_XI_EVENT_MASK_RAW_TOUCH_END;
+
+	xcb_input_xi_select_events(state->conn, state->root, 1, &em.head);
+}
+
+/*
+ * Handles the reply to a request made by the hotplug code
+ */
+static void handle_reply(struct kbd_state *state,
+		const struct pending_reply *p, void *reply)
+{
+	xcb_input_xi_query_device_reply_t *qr = reply;
+	xcb_input_xi_grab_device_reply_t *gr = reply;
+	xcb_input_xi_device_info_iterator_t di;
+	struct touch_device *dev;
+
+	switch (p->type) {
+		case PENDING_QUERY:
+			if (!qr)
+				break;
+			for (di = xcb_input_xi_query_device_infos_iterator(qr);
+					di.rem; xcb_input_xi_device_info_next(&di)) {
+				if (find_device(state, di.data->deviceid))
+					continue;
+				dev = track_device_info(state, di.data);
+				if (!dev)
+					continue;
+				fprintf(stderr, "Touch device %d added\n",
+						dev->deviceid);
+				// Raw events are already selected for all
+				// devices, so there's nothing to grab, and a
+				// hidden daemon grabs it when next shown
+				if (state->passive || !state->shown)
+					continue;
+				add_pending(state, PENDING_GRAB, dev->deviceid,
+						grab_touches(state, dev).sequence);
+			}
+			break;
+
+		case PENDING_GRAB:
+			if (gr && gr->status == XCB_GRAB_STATUS_SUCCESS)
+				break;
+			fprintf(stderr, "Failed to grab touch device %d\n",
+					p->deviceid);
+			// A daemon tries again each time it is shown
+			if (state->daemon)
+				break;
+			dev = find_device(state, p->deviceid);
+			if (dev)
+				remove_touch_device(state, dev);
+			break;
+	}
+}
+
+/*
+ * Adds and removes touch devices as they are plugged in, unplugged, enabled
+ * or disabled
+ */
+static void handle_hierarchy_event(struct kbd_state *state,
+		xcb_input_hierarchy_event_t *ev)
+{
+	xcb_input_hierarchy_info_iterator_t hi;
+	struct touch_device *dev;
+
+	for (hi = xcb_input_hierarchy_infos_iterator(ev); hi.rem;
+			xcb_input_hierarchy_info_next(&hi)) {
+		xcb_input_hierarchy_info_t *info = hi.data;
+		dev = find_device(state, info->deviceid);
+
+		if (dev && (info->flags & (XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED |
+						XCB_INPUT_HIERARCHY_MASK_DEVICE_DISABLED))) {
+			fprintf(stderr, "Touch device %d removed\n",
+					dev->deviceid);
+			remove_touch_device(state, dev);
+		} else if (!dev && info->enabled &&
+				(info->flags & (XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED |
+						XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED))) {
+			// Find out whether it can touch, without waiting
+			add_pending(state, PENDING_QUERY, info->deviceid,
+					xcb_input_xi_query_device(state->conn,
+						info->deviceid).sequence);
+		}
+	}
 }
 
 /*
- * Releases grab for the touch device
+ * Resizes a device's touch table when its number of touch slots changes
  */
-static void ungrab_touches(struct kbd_state *state)
+static void handle_device_changed(struct kbd_state *state,
+		xcb_input_device_changed_event_t *ev)
 {
-	XIUngrabDevice(state->dpy, state->input_dev, CurrentTime);
+	struct touch_device *dev = find_device(state, ev->deviceid);
+	if (!dev || ev->reason != XCB_INPUT_CHANGE_REASON_DEVICE_CHANGE)
+		return;
+
+	int nslots = direct_touch_slots(
+			xcb_input_device_changed_classes_iterator(ev));
+	if (!nslots) {
+		fprintf(stderr, "Touch device %d lost direct touch\n",
+				dev->deviceid);
+		remove_touch_device(state, dev);
+		return;
+	}
+
+	plan_valuators(state, dev,
+			xcb_input_device_changed_classes_iterator(ev));
+	if (nslots != dev->nslots) {
+		if (ensure_draw_buffers(state, nslots) ||
+				resize_touch_device(dev, nslots))
+			fprintf(stderr, "Failed to resize touch device %d\n",
+					dev->deviceid);
+		state->dirty = 1;
+	}
 }
 
 /*
@@ -131,361 +798,2548 @@ static int grab_keys(struct kbd_state *state)
  */
 static void ungrab_keys(struct kbd_state *state)
 {
-	XUngrabKey(state->dpy, AnyKey, AnyModifier, state->win);
+	XUngrabKey(state->dpy, AnyKey, AnyModifier, state->root);
 }
 
 /*
- * Creates the main window for Charade
+ * Returns the name of the keysym typed by a keystroke: the chords of the
+ * layout come first, then the keys of the on-screen keyboard
  */
-static int create_window(struct kbd_state *state)
+static const char *keystroke_name(struct kbd_state *state, int i)
 {
-	// Set up the class hint for the viewer window
-	XClassHint *class = XAllocClassHint();
-	if (!class) {
-		fprintf(stderr, "Failed to allocate class hint\n");
+	int nchords = layout_count(&state->layout);
+
+	if (i < nchords)
+		return layout_keysym(&state->layout, i);
+	return state->kbd.keys[i - nchords].keysym;
+}
+
+/*
+ * Looks up the keysym each chord of the layout and each on-screen key types
+ */
+static int init_keystrokes(struct kbd_state *state)
+{
+	int i;
+
+	state->nkeys = layout_count(&state->layout) + state->kbd.nkeys;
+	state->keys = calloc(state->nkeys, sizeof(state->keys[0]));
+	if (!state->keys) {
+		fprintf(stderr, "Failed to allocate keystrokes\n");
 		return 1;
 	}
-	class->res_name = class->res_class = "charade";
 
-	// Create the main fullscreen window
-	Screen *scr = DefaultScreenOfDisplay(state->dpy);
-	int swidth = WidthOfScreen(scr);
-	int sheight = HeightOfScreen(scr);
-	XSetWindowAttributes attrs = {
-		.background_pixel = BACKGROUND_COLOR,
-		.border_pixel = BACKGROUND_COLOR,
-		.override_redirect = True,
-		.colormap = state->cmap,
-	};
-	state->win = XCreateWindow(state->dpy, DefaultRootWindow(state->dpy),
-			0, 0, swidth, sheight, 0,
-			state->xvi.depth, InputOutput, state->xvi.visual,
-			CWBackPixel | CWBorderPixel | CWOverrideRedirect | CWColormap, &attrs);
-	XSetClassHint(state->dpy, state->win, class);
-	XSelectInput(state->dpy, state->win, StructureNotifyMask);
+	for (i = 0; i < state->nkeys; i++) {
+		const char *name = keystroke_name(state, i);
+		state->keys[i].keysym = XStringToKeysym(name);
+		if (state->keys[i].keysym == NoSymbol)
+			fprintf(stderr, "Unknown keysym %s\n", name);
+	}
+	return 0;
+}
 
-	// Free the class hint
-	XFree(class);
+/*
+ * Caches the keycodes which type each keystroke's keysym under the current
+ * keyboard mapping, so typing needs no round trip
+ */
+static void map_keystrokes(struct kbd_state *state)
+{
+	int i;
 
-	// Grab events for the new window
-	if (grab_keys(state)) {
-		fprintf(stderr, "Failed to grab keys\n");
-		goto err_destroy_win;
-	}
-	if (grab_touches(state)) {
-		fprintf(stderr, "Failed to grab touch event\n");
-		goto err_ungrab_keys;
+	state->shiftcode = XKeysymToKeycode(state->dpy, XK_Shift_L);
+	for (i = 0; i < state->nkeys; i++) {
+		struct keystroke *k = &state->keys[i];
+		k->code = 0;
+		k->shift = 0;
+		if (k->keysym == NoSymbol)
+			continue;
+		k->code = XKeysymToKeycode(state->dpy, k->keysym);
+		if (!k->code) {
+			fprintf(stderr, "No keycode for %s\n",
+					keystroke_name(state, i));
+			continue;
+		}
+		// Symbols only found on the shifted level need Shift held
+		k->shift = XkbKeycodeToKeysym(state->dpy, k->code, 0, 0) !=
+			k->keysym;
 	}
+}
 
-	return 0;
+/*
+ * Frees everything allocated by init_keystrokes
+ */
+static void free_keystrokes(struct kbd_state *state)
+{
+	free(state->keys);
+	state->keys = NULL;
+}
+
+/*
+ * Follows the word being typed and looks up its completions.  Letters extend
+ * the word, BackSpace takes one back and anything else ends it.
+ */
+static void predict_key(struct kbd_state *state, KeySym keysym)
+{
+	if (!state->dawg.map)
+		return;
+
+	if (keysym >= XK_a && keysym <= XK_z)
+		dawg_push(&state->dawg, &state->cursor, 'a' + (keysym - XK_a));
+	else if (keysym >= XK_A && keysym <= XK_Z)
+		dawg_push(&state->dawg, &state->cursor, 'a' + (keysym - XK_A));
+	else if (keysym == XK_BackSpace)
+		dawg_pop(&state->cursor);
+	else
+		dawg_reset(&state->cursor);
+
+	state->nsuggest = dawg_complete(&state->dawg, &state->cursor,
+			state->suggest, WORD_SUGGESTIONS);
+	state->dirty = 1;
+}
+
+/*
+ * Queues the fake key presses and releases which type a keystroke's keysym.
+ * They go out with the rest of the frame's requests.
+ */
+static void type_key(struct kbd_state *state, int i)
+{
+	const struct keystroke *k = &state->keys[i];
+
+	predict_key(state, k->keysym);
+	if (!state->typing || !k->code)
+		return;
+
+	if (k->shift && state->shiftcode)
+		xcb_test_fake_input(state->conn, XCB_KEY_PRESS,
+				state->shiftcode, XCB_CURRENT_TIME, XCB_NONE,
+				0, 0, 0);
+	xcb_test_fake_input(state->conn, XCB_KEY_PRESS, k->code,
+			XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+	xcb_test_fake_input(state->conn, XCB_KEY_RELEASE, k->code,
+			XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+	if (k->shift && state->shiftcode)
+		xcb_test_fake_input(state->conn, XCB_KEY_RELEASE,
+				state->shiftcode, XCB_CURRENT_TIME, XCB_NONE,
+				0, 0, 0);
+
+	// Time from the chord completing or key being touched to the
+	// keystroke leaving
+	if (!state->key_start)
+		state->key_start = state->batch_start ? state->batch_start :
+			latency_now();
+}
+
+/*
+ * Lays out the on-screen keyboard across the bottom of the screen
+ */
+static int build_keyboard(struct kbd_state *state)
+{
+	int h = state->sheight * SOFTKEY_HEIGHT;
+
+	return keyboard_build(&state->kbd, softkey_rows,
+			sizeof(softkey_rows) / sizeof(softkey_rows[0]),
+			0, state->sheight - h, state->swidth, h);
+}
+
+/*
+ * Fetches the Composite overlay window, and lets input pass through it to
+ * whatever is underneath
+ */
+static xcb_window_t get_overlay_window(struct kbd_state *state)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_composite_query_version_cookie_t vcookie;
+	xcb_composite_get_overlay_window_cookie_t ocookie;
+	xcb_composite_query_version_reply_t *version;
+	xcb_composite_get_overlay_window_reply_t *reply;
+	xcb_window_t win = XCB_NONE;
+
+	ext = xcb_get_extension_data(state->conn, &xcb_composite_id);
+	if (!ext || !ext->present)
+		return XCB_NONE;
+
+	// The overlay window needs Composite 0.3
+	vcookie = xcb_composite_query_version(state->conn, 0, 3);
+	ocookie = xcb_composite_get_overlay_window(state->conn, state->root);
+	version = xcb_composite_query_version_reply(state->conn, vcookie, NULL);
+	reply = xcb_composite_get_overlay_window_reply(state->conn, ocookie,
+			NULL);
+	if (version && (version->major_version > 0 ||
+				version->minor_version >= 3) && reply)
+		win = reply->overlay_win;
+	free(version);
+	free(reply);
+
+	if (win)
+		xcb_shape_rectangles(state->conn, XCB_SHAPE_SO_SET,
+				XCB_SHAPE_SK_INPUT, XCB_CLIP_ORDERING_UNSORTED,
+				win, 0, 0, 0, NULL);
+	return win;
+}
+
+/*
+ * Works out how frames will reach the screen, returning the window to create
+ * ours in.  A compositor, found by its owning _NET_WM_CM_S<screen>, redirects
+ * the window and only shows what was drawn on its next repaint.  Inside its
+ * overlay window the server blends our window over the composited screen as
+ * soon as it is drawn; otherwise the compositor is asked through bypass to
+ * leave the window unredirected.
+ */
+static xcb_window_t choose_path(struct kbd_state *state, xcb_atom_t *bypass)
+{
+	static const char bypass_name[] = "_NET_WM_BYPASS_COMPOSITOR";
+	xcb_intern_atom_cookie_t cm_cookie, bypass_cookie;
+	xcb_intern_atom_reply_t *atom;
+	xcb_get_selection_owner_reply_t *owner;
+	xcb_atom_t cm = XCB_NONE;
+	xcb_window_t win = XCB_NONE;
+	char cm_name[32];
+
+	snprintf(cm_name, sizeof(cm_name), "_NET_WM_CM_S%d",
+			DefaultScreen(state->dpy));
+	cm_cookie = xcb_intern_atom(state->conn, 1, strlen(cm_name), cm_name);
+	bypass_cookie = xcb_intern_atom(state->conn, 0,
+			strlen(bypass_name), bypass_name);
+
+	*bypass = XCB_NONE;
+	if ((atom = xcb_intern_atom_reply(state->conn, cm_cookie, NULL)))
+		cm = atom->atom;
+	free(atom);
+	if ((atom = xcb_intern_atom_reply(state->conn, bypass_cookie, NULL)))
+		*bypass = atom->atom;
+	free(atom);
+
+	// Nobody can own a selection whose atom doesn't exist yet
+	if (cm) {
+		owner = xcb_get_selection_owner_reply(state->conn,
+				xcb_get_selection_owner(state->conn, cm), NULL);
+		if (owner)
+			win = owner->owner;
+		free(owner);
+	}
+	if (!win) {
+		state->path = PATH_DIRECT;
+		return state->root;
+	}
+
+	if (state->overlay) {
+		state->overlay_win = get_overlay_window(state);
+		if (state->overlay_win) {
+			state->path = PATH_OVERLAY;
+			return state->overlay_win;
+		}
+		fprintf(stderr, "Composite overlay window unavailable\n");
+	}
+	state->path = PATH_COMPOSITED;
+	return state->root;
+}
+
+/*
+ * Creates the main window for Charade
+ */
+static int create_window(struct kbd_state *state)
+{
+	xcb_atom_t bypass;
+	// Set up the class hint for the viewer window
+	XClassHint *class = XAllocClassHint();
+	if (!class) {
+		fprintf(stderr, "Failed to allocate class hint\n");
+		return 1;
+	}
+	class->res_name = class->res_class = "charade";
+
+	// Create the main fullscreen window
+	XSetWindowAttributes attrs = {
+		.background_pixel = BACKGROUND_COLOR,
+		.border_pixel = BACKGROUND_COLOR,
+		.override_redirect = True,
+		.colormap = state->cmap,
+	};
+	xcb_window_t parent = choose_path(state, &bypass);
+	fprintf(stderr, "Drawing %s\n", path_names[state->path]);
+	state->win = XCreateWindow(state->dpy, parent,
+			0, 0, state->swidth, state->sheight, 0,
+			state->xvi.depth, InputOutput, state->xvi.visual,
+			CWBackPixel | CWBorderPixel | CWOverrideRedirect | CWColormap, &attrs);
+	XSetClassHint(state->dpy, state->win, class);
+	XSelectInput(state->dpy, state->win, StructureNotifyMask);
+	if (state->path == PATH_COMPOSITED && bypass) {
+		uint32_t on = 1;
+		xcb_change_property(state->conn, XCB_PROP_MODE_REPLACE,
+				state->win, bypass, XCB_ATOM_CARDINAL, 32, 1,
+				&on);
+	}
+
+	// Follow changes to the screen size
+	XSelectInput(state->dpy, state->root, StructureNotifyMask);
+
+	// Free the class hint
+	XFree(class);
+
+	// When observing passively nothing is grabbed, and the window lets all
+	// input through to whatever is underneath it
+	if (state->passive) {
+		xcb_shape_rectangles(state->conn, XCB_SHAPE_SO_SET,
+				XCB_SHAPE_SK_INPUT, XCB_CLIP_ORDERING_UNSORTED,
+				state->win, 0, 0, 0, NULL);
+		return 0;
+	}
+
+	// A daemon only grabs while it is being shown
+	if (state->daemon)
+		return 0;
+
+	// Grab events for the new window
+	if (grab_keys(state)) {
+		fprintf(stderr, "Failed to grab keys\n");
+		goto err_destroy_win;
+	}
+	if (grab_all_touches(state)) {
+		fprintf(stderr, "Failed to grab touch event\n");
+		goto err_ungrab_keys;
+	}
+
+	return 0;
+
+
+err_ungrab_keys:
+	ungrab_all_touches(state);
+	ungrab_keys(state);
+err_destroy_win:
+	XDestroyWindow(state->dpy, state->win);
+	if (state->overlay_win)
+		xcb_composite_release_overlay_window(state->conn,
+				state->root);
+	return 1;
+}
+
+static int handle_event(struct kbd_state *state, xcb_generic_event_t *ev);
+
+/*
+ * Map the main window and wait for confirmation
+ */
+static void map_window(struct kbd_state *state)
+{
+	// Map everything and wait for the notify event, handling anything else
+	// that arrives in the meantime as usual
+	xcb_map_window(state->conn, state->win);
+	xcb_flush(state->conn);
+
+	xcb_generic_event_t *ev;
+	while ((ev = xcb_wait_for_event(state->conn))) {
+		xcb_map_notify_event_t *mn = (xcb_map_notify_event_t *) ev;
+		if ((ev->response_type & ~0x80) == XCB_MAP_NOTIFY &&
+				mn->event == state->win) {
+			free(ev);
+			break;
+		}
+		handle_event(state, ev);
+		free(ev);
+	}
+}
+
+/*
+ * Tear down everything created in create_window
+ */
+static void destroy_window(struct kbd_state *state)
+{
+	if (!state->passive) {
+		ungrab_all_touches(state);
+		ungrab_keys(state);
+	}
+	XDestroyWindow(state->dpy, state->win);
+	if (state->overlay_win)
+		xcb_composite_release_overlay_window(state->conn,
+				state->root);
+}
+
+#ifdef XFT_TEXT
+/*
+ * Looks up the glyph and advance of every printable ASCII character, which is
+ * all the status text uses, so drawing it needs no lookups
+ */
+static void load_glyphs(struct kbd_state *state)
+{
+	XGlyphInfo ext;
+	int c;
+
+	for (c = ' '; c < 127; c++) {
+		state->glyphs[c] = XftCharIndex(state->dpy, state->font, c);
+		XftGlyphExtents(state->dpy, state->font, &state->glyphs[c], 1,
+				&ext);
+		state->advances[c] = ext.xOff;
+	}
+}
+
+/*
+ * Creates the pixmap the status text is kept in, or recreates it for a new
+ * screen size, starting out empty
+ */
+static void render_text(struct kbd_state *state)
+{
+	static const XRenderColor clear = {0, 0, 0, 0};
+	int h = TEXT_LINES * TEXT_PITCH;
+
+	if (state->text_draw)
+		XftDrawDestroy(state->text_draw);
+	if (state->text_pixmap)
+		xcb_free_pixmap(state->conn, state->text_pixmap);
+	state->text_pixmap = xcb_generate_id(state->conn);
+	xcb_create_pixmap(state->conn, state->xvi.depth, state->text_pixmap,
+			state->win, state->swidth, h);
+	state->text_draw = XftDrawCreate(state->dpy, state->text_pixmap,
+			state->xvi.visual, state->cmap);
+	if (state->text_draw)
+		XRenderFillRectangle(state->dpy, PictOpSrc,
+				XftDrawPicture(state->text_draw), &clear,
+				0, 0, state->swidth, h);
+	else
+		fprintf(stderr, "Couldn't create Xft draw context\n");
+
+	memset(state->text, 0, sizeof(state->text));
+	state->text_lines = 0;
+	state->text_stale = 0;
+}
+
+/*
+ * Starts a line of status text
+ */
+static void text_begin(struct text_line *t)
+{
+	t->len = 0;
+}
+
+/*
+ * Appends a character to a line of status text, as long as there is room
+ */
+static void text_char(struct text_line *t, char c)
+{
+	if (t->len < TEXT_MAX)
+		t->str[t->len++] = c;
+}
+
+/*
+ * Appends a string to a line of status text
+ */
+static void text_str(struct text_line *t, const char *s)
+{
+	while (*s)
+		text_char(t, *s++);
+}
+
+/*
+ * Appends an integer to a line of status text
+ */
+static void text_int(struct text_line *t, long v)
+{
+	char digits[24];
+	int n = 0;
+	unsigned long u = v < 0 ? -(unsigned long) v : (unsigned long) v;
+
+	if (v < 0)
+		text_char(t, '-');
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n)
+		text_char(t, digits[--n]);
+}
+
+/*
+ * Appends a number to a line of status text with the given number of decimal
+ * places, up to three
+ */
+static void text_fixed(struct text_line *t, double v, int places)
+{
+	static const long scale[] = {1, 10, 100, 1000};
+	long f = lround(fabs(v) * scale[places]);
+	long p;
+
+	if (v < 0 && f)
+		text_char(t, '-');
+	text_int(t, f / scale[places]);
+	if (!places)
+		return;
+	text_char(t, '.');
+	for (p = scale[places] / 10; p; p /= 10)
+		text_char(t, '0' + f / p % 10);
+}
+
+/*
+ * Determines whether a character of a line of status text is drawn just as
+ * before
+ */
+static int text_same(const struct text_line *old, const struct text_line *t,
+		int i)
+{
+	return i < t->len && i < old->len && t->str[i] == old->str[i] &&
+		t->x[i] == old->x[i] && t->x[i + 1] == old->x[i + 1];
+}
+
+/*
+ * Draws a line of status text into the text pixmap, counting lines up from
+ * the bottom.  Only runs of characters which differ from what was there
+ * before are cleared and redrawn.
+ */
+static void draw_text(struct kbd_state *state, int line, struct text_line *t)
+{
+	static const XRenderColor clear = {0, 0, 0, 0};
+	XftGlyphSpec specs[TEXT_MAX];
+	int i, k;
+
+	if (line >= TEXT_LINES || !state->text_draw)
+		return;
+	struct text_line *old = &state->text[line];
+	int baseline = (TEXT_LINES - line) * TEXT_PITCH - 10;
+	int top = baseline - state->font->ascent;
+	int height = state->font->ascent + state->font->descent;
+
+	t->x[0] = 0;
+	for (i = 0; i < t->len; i++) {
+		unsigned char c = t->str[i];
+		if (c < ' ' || c > '~')
+			t->str[i] = c = '?';
+		t->x[i + 1] = t->x[i] + state->advances[c];
+	}
+
+	int n = t->len > old->len ? t->len : old->len;
+	for (i = 0; i < n; ) {
+		if (text_same(old, t, i)) {
+			i++;
+			continue;
+		}
+		int a = i;
+		while (i < n && !text_same(old, t, i))
+			i++;
+
+		// Clear wherever the run was or now is, then draw its new
+		// characters
+		int na = a < t->len ? a : t->len, ni = i < t->len ? i : t->len;
+		int oa = a < old->len ? a : old->len;
+		int oi = i < old->len ? i : old->len;
+		int x0 = t->x[na] < old->x[oa] ? t->x[na] : old->x[oa];
+		int x1 = t->x[ni] > old->x[oi] ? t->x[ni] : old->x[oi];
+		if (x1 > x0)
+			XRenderFillRectangle(state->dpy, PictOpSrc,
+					XftDrawPicture(state->text_draw),
+					&clear, x0, top, x1 - x0, height);
+
+		int nspecs = 0;
+		for (k = na; k < ni; k++) {
+			if (t->str[k] == ' ')
+				continue;
+			specs[nspecs++] = (XftGlyphSpec) {
+				.glyph = state->glyphs[(unsigned char) t->str[k]],
+				.x = t->x[k],
+				.y = baseline,
+			};
+		}
+		if (nspecs)
+			XftDrawGlyphSpec(state->text_draw, &state->textclr,
+					state->font, specs, nspecs);
+	}
+
+	old->len = t->len;
+	memcpy(old->str, t->str, t->len);
+	memcpy(old->x, t->x, (t->len + 1) * sizeof(t->x[0]));
+}
+
+/*
+ * Clears any lines of status text left over from the last frame, then
+ * composites the lines in use onto the window
+ */
+static void finish_text(struct kbd_state *state, int lines)
+{
+	struct text_line empty = {.len = 0};
+	int i, width = 0;
+
+	if (lines > TEXT_LINES)
+		lines = TEXT_LINES;
+	for (i = lines; i < state->text_lines; i++)
+		draw_text(state, i, &empty);
+	state->text_lines = lines;
+	if (!state->text_draw)
+		return;
+
+	for (i = 0; i < lines; i++)
+		if (state->text[i].x[state->text[i].len] > width)
+			width = state->text[i].x[state->text[i].len];
+	int h = TEXT_LINES * TEXT_PITCH;
+	int top = h - lines * TEXT_PITCH;
+	if (width)
+		XRenderComposite(state->dpy, PictOpOver,
+				XftDrawPicture(state->text_draw), None,
+				XftDrawPicture(state->draw), 0, top, 0, 0,
+				0, state->sheight - h + top, width, h - top);
+}
+#endif
+
+#ifdef XFT_TEXT
+/*
+ * Does the fontconfig half of matching the status text font.  Loading the
+ * configuration and font caches the first time is the slowest part of
+ * startup, so it runs in its own thread while the rest goes ahead.  Nothing
+ * here touches the display.
+ */
+static void *match_font(void *arg)
+{
+	struct kbd_state *state = arg;
+	uint64_t start = latency_now();
+
+	FcPattern *pat = XftNameParse(TEXT_FONT);
+	if (pat && !FcConfigSubstitute(NULL, pat, FcMatchPattern)) {
+		FcPatternDestroy(pat);
+		pat = NULL;
+	}
+	state->font_pattern = pat;
+	state->font_time = latency_now() - start;
+	return NULL;
+}
+
+/*
+ * Starts matching the font in the background, or just matches it if no
+ * thread can be had
+ */
+static void start_font_match(struct kbd_state *state)
+{
+	state->font_started = !pthread_create(&state->font_thread, NULL,
+			match_font, state);
+	if (!state->font_started)
+		match_font(state);
+}
+
+/*
+ * Waits for start_font_match to finish
+ */
+static void wait_font_match(struct kbd_state *state)
+{
+	if (!state->font_started)
+		return;
+	pthread_join(state->font_thread, NULL);
+	state->font_started = 0;
+}
+
+/*
+ * Finishes matching the font in the same order XftFontMatch would, with the
+ * defaults which come from the display, and opens it
+ */
+static XftFont *open_font(struct kbd_state *state)
+{
+	FcPattern *pat, *match;
+	FcResult result;
+	XftFont *font;
+
+	mark_phase(state, PHASE_DRAW);
+	wait_font_match(state);
+	mark_phase(state, PHASE_FONT_WAIT);
+
+	pat = state->font_pattern;
+	state->font_pattern = NULL;
+	if (!pat)
+		return NULL;
+	XftDefaultSubstitute(state->dpy, DefaultScreen(state->dpy), pat);
+	match = FcFontMatch(NULL, pat, &result);
+	FcPatternDestroy(pat);
+	if (!match)
+		return NULL;
+
+	// The font takes over the pattern if it opens
+	font = XftFontOpenPattern(state->dpy, match);
+	if (!font)
+		FcPatternDestroy(match);
+	return font;
+}
+#endif
+
+/*
+ * Initializes drawing context
+ */
+static int setup_draw(struct kbd_state *state)
+{
+	state->gc = xcb_generate_id(state->conn);
+	xcb_create_gc(state->conn, state->gc, state->win, 0, NULL);
+
+#ifdef XFT_TEXT
+	XRenderColor xrc;
+	state->draw = XftDrawCreate(state->dpy, state->win, state->xvi.visual,
+			state->cmap);
+	if (!state->draw) {
+		fprintf(stderr, "Couldn't create Xft draw context\n");
+		goto err_free_gc;
+	}
+
+	xrc = TEXT_COLOR;
+	if (!XftColorAllocValue(state->dpy, state->xvi.visual, state->cmap,
+				&xrc, &state->textclr)) {
+		fprintf(stderr, "Couldn't allocate Xft color\n");
+		goto err_destroy_draw;
+	}
+
+	state->font = open_font(state);
+	if (!state->font) {
+		fprintf(stderr, "Couldn't load Xft font\n");
+		goto err_free_color;
+	}
+	load_glyphs(state);
+	state->text_stale = 1;
+#endif
+	return 0;
+
+
+#ifdef XFT_TEXT
+err_free_color:
+	XftColorFree(state->dpy, state->xvi.visual, state->cmap, &state->textclr);
+err_destroy_draw:
+	XftDrawDestroy(state->draw);
+err_free_gc:
+	xcb_free_gc(state->conn, state->gc);
+	return 1;
+#endif
+}
+
+/*
+ * Tears down drawing context
+ */
+static void cleanup_draw(struct kbd_state *state)
+{
+	if (state->kbd_pixmap)
+		xcb_free_pixmap(state->conn, state->kbd_pixmap);
+#ifdef XFT_TEXT
+	if (state->text_draw)
+		XftDrawDestroy(state->text_draw);
+	if (state->text_pixmap)
+		xcb_free_pixmap(state->conn, state->text_pixmap);
+	XftFontClose(state->dpy, state->font);
+	XftColorFree(state->dpy, state->xvi.visual, state->cmap, &state->textclr);
+	XftDrawDestroy(state->draw);
+#endif
+	xcb_free_gc(state->conn, state->gc);
+}
+
+/*
+ * Sets the foreground color used for subsequent drawing requests
+ */
+static void set_color(struct kbd_state *state, uint32_t color)
+{
+	xcb_change_gc(state->conn, state->gc, XCB_GC_FOREGROUND, &color);
+}
+
+/*
+ * Draws a closed polygon as a single PolyLine request
+ */
+static void draw_polygon(struct kbd_state *state, const struct point *pts,
+		int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		state->lines[i].x = pts[i].x;
+		state->lines[i].y = 1080 - pts[i].y;
+	}
+	state->lines[n] = state->lines[0];
+	xcb_poly_line(state->conn, XCB_COORD_MODE_ORIGIN, state->win, state->gc,
+			n + 1, state->lines);
+}
+
+/*
+ * Returns a key's rectangle, less the gap between keys, offset by (dx, dy)
+ */
+static xcb_rectangle_t softkey_rect(const struct softkey *k, int dx, int dy)
+{
+	return (xcb_rectangle_t) {
+		.x = k->x + SOFTKEY_GAP + dx,
+		.y = k->y + SOFTKEY_GAP + dy,
+		.width = k->w > 2 * SOFTKEY_GAP ? k->w - 2 * SOFTKEY_GAP : 1,
+		.height = k->h > 2 * SOFTKEY_GAP ? k->h - 2 * SOFTKEY_GAP : 1,
+	};
+}
+
+/*
+ * Draws the keys and their labels into a pixmap, once per keyboard layout,
+ * so frames only have to copy it
+ */
+static void render_keyboard(struct kbd_state *state)
+{
+	const struct keyboard *kb = &state->kbd;
+	int i;
+
+	if (state->kbd_pixmap)
+		xcb_free_pixmap(state->conn, state->kbd_pixmap);
+	state->kbd_pixmap = xcb_generate_id(state->conn);
+	xcb_create_pixmap(state->conn, state->xvi.depth, state->kbd_pixmap,
+			state->win, kb->w, kb->h);
+
+	xcb_rectangle_t all = {0, 0, kb->w, kb->h};
+	set_color(state, TRANSPARENT);
+	xcb_poly_fill_rectangle(state->conn, state->kbd_pixmap, state->gc, 1,
+			&all);
+	set_color(state, SOFTKEY_COLOR);
+	for (i = 0; i < kb->nkeys; i++) {
+		xcb_rectangle_t r = softkey_rect(&kb->keys[i], -kb->x, -kb->y);
+		xcb_poly_fill_rectangle(state->conn, state->kbd_pixmap,
+				state->gc, 1, &r);
+	}
+
+#ifdef XFT_TEXT
+	XftDraw *draw = XftDrawCreate(state->dpy, state->kbd_pixmap,
+			state->xvi.visual, state->cmap);
+	if (!draw) {
+		fprintf(stderr, "Couldn't create Xft draw context\n");
+	} else {
+		for (i = 0; i < kb->nkeys; i++) {
+			const struct softkey *k = &kb->keys[i];
+			const XftChar8 *label = (const XftChar8 *) k->keysym;
+			int len = strlen(k->keysym);
+			XGlyphInfo ext;
+			XftTextExtentsUtf8(state->dpy, state->font, label, len,
+					&ext);
+			XftDrawStringUtf8(draw, &state->textclr, state->font,
+					k->x - kb->x + (k->w - ext.xOff) / 2,
+					k->y - kb->y + (k->h + state->font->ascent -
+						state->font->descent) / 2,
+					label, len);
+		}
+		XftDrawDestroy(draw);
+	}
+#endif
+
+	state->kbd_stale = 0;
+}
+
+/*
+ * Draws the on-screen keyboard from its pixmap, highlighting the keys which
+ * are being touched
+ */
+static void draw_keyboard(struct kbd_state *state)
+{
+	const struct keyboard *kb = &state->kbd;
+	int i, j;
+
+	if (state->kbd_stale)
+		render_keyboard(state);
+	xcb_copy_area(state->conn, state->kbd_pixmap, state->win, state->gc,
+			0, 0, kb->x, kb->y, kb->w, kb->h);
+
+	set_color(state, SOFTKEY_PRESSED_COLOR);
+	for (i = 0; i < state->ndevs; i++) {
+		struct touch_device *dev = state->devlist[i];
+		int n = 0;
+		for (j = 0; j < dev->touches; j++)
+			if (dev->touchtrack[j].key >= 0)
+				state->rects[n++] = softkey_rect(
+						&kb->keys[dev->touchtrack[j].key],
+						0, 0);
+		if (n)
+			xcb_poly_fill_rectangle(state->conn, state->win,
+					state->gc, n, state->rects);
+	}
+}
+
+/*
+ * Picks a label for each group of touches found by points_cluster: the label
+ * most of its touches had last time that no earlier group has taken, or else a
+ * fresh one.  The labels follow the groups in the device's groups buffer.
+ */
+static void label_groups(struct touch_device *dev, int ngroups)
+{
+	const int *group = dev->groups;
+	int *label = dev->groups + dev->nslots;
+	int g, i, j, k;
+
+	for (g = 0; g < ngroups; g++) {
+		int best = -1, bestn = 0;
+		for (i = 0; i < dev->touches; i++) {
+			int l = dev->touchtrack[i].cluster;
+			if (group[i] != g || l < 0 || l == best)
+				continue;
+			for (k = 0; k < g && label[k] != l; k++)
+				;
+			if (k < g)
+				continue;
+
+			// Earlier touches with this label were counted already
+			int n = 0;
+			for (j = i; j < dev->touches; j++)
+				n += group[j] == g && dev->touchtrack[j].cluster == l;
+			if (n > bestn) {
+				best = l;
+				bestn = n;
+			}
+		}
+		label[g] = best >= 0 ? best : dev->nextlabel++;
+	}
+}
+
+/*
+ * Computes a cluster's hull, noting which touch each vertex is
+ */
+static void compute_hull(struct touch_device *dev, struct touch_cluster *cl)
+{
+	int k, m;
+
+	if (cl->n < 2) {
+		cl->hull[0] = cl->pts[0];
+		cl->nhull = 1;
+	} else {
+		cl->nhull = points_convex_hull(cl->pts, cl->n, cl->hull,
+				dev->work);
+	}
+
+	// Hull points are copies of the cluster's points
+	for (k = 0; k < cl->nhull; k++) {
+		for (m = 0; m < cl->n; m++)
+			if (cl->pts[m].x == cl->hull[k].x &&
+					cl->pts[m].y == cl->hull[k].y)
+				break;
+		cl->hullids[k] = m < cl->n ? dev->touchids[cl->members[m]] : -1;
+	}
+}
+
+/*
+ * Finds the IDs of a cluster's touches in order around its hull, starting from
+ * the lowest.  Returns how many there are.
+ */
+static int hull_order(const struct touch_cluster *cl, int *order)
+{
+	int k, first = 0;
+
+	for (k = 1; k < cl->nhull; k++)
+		if (cl->hullids[k] < cl->hullids[first])
+			first = k;
+	for (k = 0; k < cl->nhull; k++)
+		order[k] = cl->hullids[(first + k) % cl->nhull];
+	return cl->nhull;
+}
+
+/*
+ * Costs of matching the cluster's touches to the anchors of the hand model,
+ * moved by the given offset: their squared distances
+ */
+static void finger_costs(const struct touch_device *dev,
+		const struct touch_cluster *cl, struct point off, double *cost)
+{
+	int m, f;
+
+	for (m = 0; m < cl->n; m++) {
+		for (f = 0; f < CHORD_MAX_FINGERS; f++) {
+			double dx = cl->pts[m].x - dev->anchors[f].x - off.x;
+			double dy = cl->pts[m].y - dev->anchors[f].y - off.y;
+			cost[m * CHORD_MAX_FINGERS + f] = dx * dx + dy * dy;
+		}
+	}
+}
+
+/*
+ * Works out which finger of the hand model each of a cluster's touches is.
+ * The hand is assumed upright, as in the model, and placed first by centroid
+ * and then by the mean offset of the touches from the anchors they were
+ * matched to.  The assignment stands until the order around the hull changes
+ * or touches join or leave.
+ */
+static void assign_fingers(struct touch_device *dev, struct touch_cluster *cl)
+{
+	static const char names[] = "TIMRL";
+	double cost[ASSIGN_MAX * CHORD_MAX_FINGERS];
+	int order[ASSIGN_MAX], match[ASSIGN_MAX];
+	int m, k, pass;
+
+	if (cl->n < 2 || cl->n > ASSIGN_MAX) {
+		for (m = 0; m < cl->n; m++)
+			dev->touchtrack[cl->members[m]].finger = -1;
+		cl->norder = 0;
+		cl->fingers[0] = '\0';
+		return;
+	}
+
+	int norder = hull_order(cl, order);
+	if (cl->fingers_membership == cl->membership &&
+			norder == cl->norder &&
+			!memcmp(order, cl->order, norder * sizeof(order[0])))
+		return;
+
+	struct point tc = points_centroid(cl->pts, cl->n);
+	struct point ac = points_centroid(dev->anchors, CHORD_MAX_FINGERS);
+	struct point off = POINT(tc.x - ac.x, tc.y - ac.y);
+	for (pass = 0; pass < 2; pass++) {
+		finger_costs(dev, cl, off, cost);
+		assign_solve(&cl->assign, cost, cl->n, CHORD_MAX_FINGERS,
+				match);
+
+		int matched = 0;
+		off = POINT(0, 0);
+		for (m = 0; m < cl->n; m++) {
+			if (match[m] < 0)
+				continue;
+			off.x += cl->pts[m].x - dev->anchors[match[m]].x;
+			off.y += cl->pts[m].y - dev->anchors[match[m]].y;
+			matched++;
+		}
+		off.x /= matched;
+		off.y /= matched;
+	}
+
+	for (m = 0; m < cl->n; m++) {
+		struct touch_track *tt = &dev->touchtrack[cl->members[m]];
+		tt->finger = match[m];
+		tt->hand = cl->label;
+	}
+	memcpy(cl->order, order, norder * sizeof(order[0]));
+	cl->norder = norder;
+
+	// Fingers as met going round the hull, for display
+	for (k = 0; k < norder; k++) {
+		for (m = 0; m < cl->n &&
+				dev->touchids[cl->members[m]] != order[k]; m++)
+			;
+		cl->fingers[k] = m < cl->n && match[m] >= 0 ?
+			names[match[m]] : '?';
+	}
+	cl->fingers[norder] = '\0';
+}
+
+/*
+ * Brings one of a cluster's analysis results up to date, along with whatever
+ * it depends on, unless it already is
+ */
+static void cluster_need(struct touch_device *dev, struct touch_cluster *cl,
+		enum cluster_result r)
+{
+	unsigned long dep;
+
+	if (r == RESULT_HULL) {
+		dep = cl->shape;
+	} else {
+		cluster_need(dev, cl, RESULT_HULL);
+		dep = cl->at[RESULT_HULL];
+	}
+	if (cl->at[r] == dep && (r != RESULT_FINGERS ||
+				cl->fingers_membership == cl->membership)) {
+		dev->reused[r]++;
+		return;
+	}
+	dev->computed[r]++;
+
+	switch (r) {
+		case RESULT_HULL:
+			compute_hull(dev, cl);
+			break;
+		case RESULT_AREA:
+			cl->area = (int) polygon_area(cl->hull, cl->nhull);
+			break;
+		case RESULT_BBOX:
+			points_oriented_bbox(cl->hull, cl->nhull, cl->bbox);
+			break;
+		case RESULT_CENTER:
+			// The smallest enclosing circle of the touches is that
+			// of their hull
+			cl->center = points_enclosing_center(cl->hull,
+					cl->nhull);
+			break;
+		case RESULT_FINGERS:
+			assign_fingers(dev, cl);
+			cl->fingers_membership = cl->membership;
+			break;
+		default:
+			return;
+	}
+	cl->at[r] = dep;
+}
+
+/*
+ * Determines whether a change to a cluster's touches can have moved its hull.
+ * It can't if no hull vertex moved or left, and every touch which moved or
+ * joined is still strictly inside.  Tells nothing unless the hull is up to
+ * date.
+ */
+static int hull_unchanged(const struct touch_device *dev,
+		const struct touch_cluster *cl, const int *moved, int nmoved)
+{
+	int i, k, m;
+
+	if (cl->at[RESULT_HULL] != cl->shape || cl->nhull < 3)
+		return 0;
+
+	for (k = 0; k < cl->nhull; k++) {
+		for (m = 0; m < cl->n &&
+				dev->touchids[cl->members[m]] != cl->hullids[k]; m++)
+			;
+		if (m == cl->n)
+			return 0;
+	}
+	for (i = 0; i < nmoved; i++) {
+		int id = dev->touchids[moved[i]];
+		for (k = 0; k < cl->nhull && cl->hullids[k] != id; k++)
+			;
+		if (k < cl->nhull || !polygon_contains(cl->hull, cl->nhull,
+					dev->touchpts[moved[i]]))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Works out how fast a hand is moving, how fast that is changing, and how far
+ * its touches have travelled on average, from snapshots of their histories
+ */
+static void cluster_motion(const struct touch_device *dev,
+		struct touch_cluster *cl)
+{
+	struct touch_sample s[HISTORY_LEN];
+	double vx = 0, vy = 0, ax = 0, ay = 0, path = 0;
+	int m, nv = 0, na = 0;
+
+	for (m = 0; m < cl->n; m++) {
+		int n = history_snapshot(dev->touchhist[cl->members[m]], s,
+				HISTORY_LEN);
+		int k = n < MOTION_SAMPLES ? n : MOTION_SAMPLES;
+		double x, y;
+
+		path += history_path(s, n);
+		if (history_velocity(s + n - k, k, &x, &y)) {
+			vx += x;
+			vy += y;
+			nv++;
+		}
+		if (history_acceleration(s + n - k, k, &x, &y)) {
+			ax += x;
+			ay += y;
+			na++;
+		}
+	}
+
+	cl->speed = nv ? hypot(vx, vy) / nv : 0;
+	cl->accel = na ? hypot(ax, ay) / na : 0;
+	cl->path = cl->n ? path / cl->n : 0;
+}
+
+/*
+ * Groups one device's current touches into hands and works out, for each
+ * hand whose touches changed, which of its analysis results that affects,
+ * then brings just those up to date.  Only touches the device's own buffers,
+ * so devices can be analysed in parallel.
+ */
+static void analyse_device(void *arg)
+{
+	struct touch_device *dev = arg;
+	const int *group = dev->groups;
+	const int *label = dev->groups + dev->nslots;
+	int *moved = dev->groups + 2 * dev->nslots;
+	int g, i, c;
+
+	int ngroups = points_cluster(dev->touchpts, dev->touches, CLUSTER_DIST,
+			dev->groups);
+	label_groups(dev, ngroups);
+
+	// Drop clusters whose hands have gone, swapping rather than copying so
+	// each keeps its own buffers
+	for (c = 0; c < dev->nclusters; ) {
+		for (g = 0; g < ngroups && label[g] != dev->clusters[c].label; g++)
+			;
+		if (g < ngroups) {
+			c++;
+			continue;
+		}
+		struct touch_cluster cl = dev->clusters[c];
+		dev->clusters[c] = dev->clusters[--dev->nclusters];
+		dev->clusters[dev->nclusters] = cl;
+	}
+
+	for (g = 0; g < ngroups; g++) {
+		for (c = 0; c < dev->nclusters &&
+				dev->clusters[c].label != label[g]; c++)
+			;
+		struct touch_cluster *cl = &dev->clusters[c];
+		if (c == dev->nclusters) {
+			cl->label = label[g];
+			cl->n = 0;
+			cl->norder = 0;
+			cl->shape = cl->membership = 1;
+			memset(cl->at, 0, sizeof(cl->at));
+			cl->fingers_membership = 0;
+			assign_reset(&cl->assign);
+			dev->nclusters++;
+		}
+
+		// Touches which moved or joined, and whether any touch joined
+		// or left
+		int n = 0, nmoved = 0, joined = 0;
+		for (i = 0; i < dev->touches; i++) {
+			struct touch_track *tt = &dev->touchtrack[i];
+			if (group[i] != g)
+				continue;
+			joined |= tt->cluster != cl->label;
+			if (tt->moved || tt->cluster != cl->label)
+				moved[nmoved++] = i;
+			cl->members[n] = i;
+			cl->pts[n++] = dev->touchpts[i];
+			tt->cluster = cl->label;
+			tt->moved = 0;
+		}
+		int left = !joined && n != cl->n;
+		cl->n = n;
+
+		if (joined || left)
+			cl->membership++;
+		if ((nmoved || left) && !hull_unchanged(dev, cl, moved, nmoved))
+			cl->shape++;
+	}
+
+	// Single touches aren't analysed
+	for (c = 0; c < dev->nclusters; c++) {
+		struct touch_cluster *cl = &dev->clusters[c];
+		if (cl->n < 2)
+			continue;
+		cluster_need(dev, cl, RESULT_AREA);
+		cluster_need(dev, cl, RESULT_BBOX);
+		cluster_need(dev, cl, RESULT_CENTER);
+		cluster_need(dev, cl, RESULT_FINGERS);
+		cluster_motion(dev, cl);
+	}
+}
+
+/*
+ * Writes a gesture event to standard output
+ */
+static void emit_gesture(struct touch_device *dev, const char *type,
+		const struct similarity *t)
+{
+	printf("gesture %s %d %.1f %.1f %.4f %.4f\n", type, dev->deviceid,
+			t->t.x, t->t.y, t->angle, t->scale);
+}
+
+/*
+ * Emits whatever happened to a device's gesture during the last batch of
+ * events, with at most one update per batch
+ */
+static int emit_gestures(struct touch_device *dev)
+{
+	struct gesture_state *gs = &dev->gesture;
+	struct similarity seg;
+
+	if (!gs->events)
+		return 0;
+
+	if (gs->active && gesture_solve(&gs->sums, &seg))
+		gs->total = similarity_compose(&seg, &gs->base);
+
+	// A gesture may have ended and another begun within the batch
+	if ((gs->events & GESTURE_END) && gs->active)
+		emit_gesture(dev, "end", &gs->final);
+	if (gs->events & GESTURE_BEGIN)
+		emit_gesture(dev, "begin", &gs->total);
+	if ((gs->events & GESTURE_UPDATE) && gs->active)
+		emit_gesture(dev, "update", &gs->total);
+	if ((gs->events & GESTURE_END) && !gs->active)
+		emit_gesture(dev, "end", &gs->final);
+
+	gs->events = 0;
+	return 1;
+}
+
+/*
+ * Brings the analysis up to date for every device whose touches changed in
+ * the last batch of events
+ */
+static void analyse_devices(struct kbd_state *state)
+{
+	void *jobs[MAX_DEVICES];
+	int i, njobs = 0;
+	int emitted = 0;
+
+	for (i = 0; i < state->ndevs; i++) {
+		struct touch_device *dev = state->devlist[i];
+		emitted |= emit_gestures(dev);
+		if (dev->dirty)
+			jobs[njobs++] = dev;
+		dev->dirty = 0;
+	}
+	if (emitted)
+		fflush(stdout);
+
+	workers_run(state->workers, analyse_device, jobs, njobs);
+
+	for (i = 0; i < njobs; i++) {
+		struct touch_device *dev = jobs[i];
+		int r;
+		for (r = 0; r < NRESULTS; r++) {
+			state->stats.reused[r] += dev->reused[r];
+			state->stats.computed[r] += dev->computed[r];
+			dev->reused[r] = dev->computed[r] = 0;
+		}
+	}
+}
+
+/*
+ * Returns how far ahead, in seconds, touch markers should be extrapolated: the
+ * typical time from receiving an event to flushing its frame, plus an
+ * allowance for getting the frame onto the screen
+ */
+static double prediction_horizon(struct kbd_state *state)
+{
+	return latency_percentile(&state->lat_frame, 50) / 1e9 +
+		PREDICT_EXTRA_MS / 1000.0;
+}
+
+/*
+ * Returns the position at which to draw a touch.  Touches which moved in the
+ * current batch are extrapolated along their filtered velocity; the others
+ * are assumed to have stopped.
+ */
+static struct point predict_touch(struct kbd_state *state,
+		struct touch_device *dev, int idx, double horizon)
+{
+	const struct touch_track *tt = &dev->touchtrack[idx];
+
+	if (!state->predict)
+		return dev->touchpts[idx];
+	if (tt->batch != state->batch)
+		horizon = 0;
+	return POINT(oneeuro_predict(&tt->fx, horizon),
+			oneeuro_predict(&tt->fy, horizon));
+}
+
+/*
+ * Draws the window.  Requests are only queued here; the caller flushes once
+ * per batch of events.
+ */
+static void update_display(struct kbd_state *state)
+{
+	int i, j;
+	int touches = 0;
+#ifdef XFT_TEXT
+	struct text_line t;
+	int line = 1;
+#endif
+
+	analyse_devices(state);
+
+	xcb_clear_area(state->conn, 0, state->win, 0, 0, 0, 0);
+	if (state->softkeys)
+		draw_keyboard(state);
+
+	// Draw touches where we expect them to be by the time they're seen
+	double horizon = prediction_horizon(state);
+	set_color(state, TOUCH_COLOR);
+	for (i = 0; i < state->ndevs; i++) {
+		struct touch_device *dev = state->devlist[i];
+		for (j = 0; j < dev->touches; j++) {
+			struct point p = predict_touch(state, dev, j, horizon);
+			state->arcs[j] = (xcb_arc_t) {
+				.x = p.x - TOUCH_RADIUS,
+				.y = 1080 - p.y - TOUCH_RADIUS,
+				.width = 2 * TOUCH_RADIUS,
+				.height = 2 * TOUCH_RADIUS,
+				.angle1 = 0,
+				.angle2 = 360 * 64,
+			};
+		}
+		if (dev->touches)
+			xcb_poly_fill_arc(state->conn, state->win, state->gc,
+					dev->touches, state->arcs);
+		touches += dev->touches;
+	}
+
+	// Print calculated data
+#ifdef XFT_TEXT
+	if (state->text_stale)
+		render_text(state);
+	text_begin(&t);
+	text_str(&t, "Touches: ");
+	text_int(&t, touches);
+	draw_text(state, 0, &t);
+#else
+	printf("Touches: %d\n", touches);
+#endif
+
+	// Completions of the word being typed
+	if (state->nsuggest) {
+#ifdef XFT_TEXT
+		text_begin(&t);
+		text_str(&t, "Words:");
+		for (j = 0; j < state->nsuggest; j++) {
+			text_str(&t, "  ");
+			text_str(&t, state->suggest[j]);
+		}
+		draw_text(state, line++, &t);
+#else
+		printf("Words:");
+		for (j = 0; j < state->nsuggest; j++)
+			printf("  %s", state->suggest[j]);
+		printf("\n");
+#endif
+	}
+
+	set_color(state, ANALYSIS_COLOR);
+	for (i = 0; i < state->ndevs; i++) {
+		struct touch_device *dev = state->devlist[i];
+		for (j = 0; j < dev->nclusters; j++) {
+			struct touch_cluster *cl = &dev->clusters[j];
+			if (cl->n < 2)
+				continue;
+
+			// Draw convex hull and bounding box
+			draw_polygon(state, cl->hull, cl->nhull);
+			draw_polygon(state, cl->bbox, 4);
+
+			// Draw center
+			xcb_rectangle_t rect = {
+				.x = cl->center.x - CENTER_RADIUS,
+				.y = 1080 - cl->center.y - CENTER_RADIUS,
+				.width = 2 * CENTER_RADIUS,
+				.height = 2 * CENTER_RADIUS,
+			};
+			xcb_poly_fill_rectangle(state->conn, state->win,
+					state->gc, 1, &rect);
+
+			// Print analysis text
+#ifdef XFT_TEXT
+			text_begin(&t);
+			text_char(&t, 'H');
+			text_int(&t, cl->label);
+			text_str(&t, ": C = (");
+			text_fixed(&t, cl->center.x, 1);
+			text_str(&t, ", ");
+			text_fixed(&t, cl->center.y, 1);
+			text_str(&t, ")   A = ");
+			text_int(&t, cl->area);
+			text_str(&t, "   F = ");
+			text_str(&t, cl->fingers);
+			text_str(&t, "   V = ");
+			text_fixed(&t, cl->speed, 0);
+			text_str(&t, "   dV = ");
+			text_fixed(&t, cl->accel, 0);
+			text_str(&t, "   L = ");
+			text_fixed(&t, cl->path, 0);
+			draw_text(state, line++, &t);
+#else
+			printf("H%d: C = (%.1f, %.1f)\tA = %d\tF = %s\t"
+					"V = %.0f\tdV = %.0f\tL = %.0f\n",
+					cl->label, cl->center.x, cl->center.y,
+					cl->area, cl->fingers, cl->speed,
+					cl->accel, cl->path);
+#endif
+		}
+
+		if (dev->chord.last >= 0) {
+			const char *keysym = layout_keysym(&state->layout,
+					dev->chord.last);
+#ifdef XFT_TEXT
+			text_begin(&t);
+			text_str(&t, "Chord: ");
+			text_str(&t, keysym);
+			draw_text(state, line++, &t);
+#else
+			printf("Chord: %s\n", keysym);
+#endif
+		}
+
+		if (!dev->gesture.active)
+			continue;
+		const struct similarity *sim = &dev->gesture.total;
+#ifdef XFT_TEXT
+		text_begin(&t);
+		text_str(&t, "T = (");
+		text_fixed(&t, sim->t.x, 1);
+		text_str(&t, ", ");
+		text_fixed(&t, sim->t.y, 1);
+		text_str(&t, ")   R = ");
+		text_fixed(&t, sim->angle * 180 / M_PI, 1);
+		text_str(&t, "   S = ");
+		text_fixed(&t, sim->scale, 2);
+		draw_text(state, line++, &t);
+#else
+		printf("T = (%.1f, %.1f)\tR = %.1f\tS = %.2f\n", sim->t.x,
+				sim->t.y, sim->angle * 180 / M_PI, sim->scale);
+#endif
+	}
+
+#ifdef XFT_TEXT
+	finish_text(state, line);
+#endif
+}
+
+/*
+ * Find the index of a given touch ID in the internal array
+ */
+static int get_touch_index(struct touch_device *dev, int id)
+{
+	int i;
+	for (i = 0; i < dev->touches; i++)
+		if (dev->touchids[i] == id)
+			return i;
+	return -1;
+}
+
+/*
+ * Records a touch and its info
+ */
+static int add_touch(struct touch_device *dev, int id, double x, double y,
+		uint32_t time)
+{
+	// Should always have allocated enough slots for device max
+	assert(dev->touches < dev->nslots);
+
+	// Fill it out
+	dev->touchids[dev->touches] = id;
+	dev->touchpts[dev->touches].x = x;
+	dev->touchpts[dev->touches].y = y;
+	memset(&dev->touchattrs[dev->touches], 0, sizeof(dev->touchattrs[0]));
+	dev->touchtrack[dev->touches] = (struct touch_track) {
+		.time = time,
+		.down = POINT(x, y),
+		.key = -1,
+		.timer = -1,
+		.cluster = -1,
+		.moved = 1,
+		.finger = -1,
+		.hand = -1,
+	};
+	history_begin(dev->touchhist[dev->touches], time, x, y);
+	dev->touches++;
+	return 0;
+}
+
+/*
+ * Removes a touch record
+ */
+static void remove_touch(struct touch_device *dev, int idx)
+{
+	assert(idx >= 0 && idx < dev->touches);
+
+	dev->touches--;
+	if (idx < dev->touches) {
+		dev->touchids[idx] = dev->touchids[dev->touches];
+		dev->touchpts[idx] = dev->touchpts[dev->touches];
+		dev->touchattrs[idx] = dev->touchattrs[dev->touches];
+		dev->touchtrack[idx] = dev->touchtrack[dev->touches];
+
+		// Swap rings rather than copying them, which also keeps every
+		// ring owned by exactly one slot
+		struct touch_history *hist = dev->touchhist[idx];
+		dev->touchhist[idx] = dev->touchhist[dev->touches];
+		dev->touchhist[dev->touches] = hist;
+	}
+}
+
+/*
+ * Updates a touch record
+ */
+static void update_touch(struct touch_device *dev, int idx, double x, double y,
+		uint32_t time)
+{
+	assert(idx >= 0 && idx < dev->touches);
+
+	dev->touchpts[idx].x = x;
+	dev->touchpts[idx].y = y;
+	dev->touchtrack[idx].time = time;
+	dev->touchtrack[idx].moved = 1;
+	history_push(dev->touchhist[idx], time, x, y);
+}
+
+/*
+ * Starts the gesture over from the current touches, folding whatever the
+ * previous set of touches did into its running total.  Called whenever a touch
+ * is added or removed; the gesture begins and ends as the number of touches
+ * crosses GESTURE_MIN_TOUCHES.
+ */
+static void regesture(struct touch_device *dev)
+{
+	struct gesture_state *gs = &dev->gesture;
+	struct similarity seg;
+	int i;
+
+	if (gs->active && gesture_solve(&gs->sums, &seg)) {
+		gs->total = similarity_compose(&seg, &gs->base);
+		gs->base = gs->total;
+	}
+	gesture_sums_reset(&gs->sums);
+
+	if (dev->touches < GESTURE_MIN_TOUCHES) {
+		if (gs->active) {
+			gs->active = 0;
+			gs->final = gs->total;
+			gs->events |= GESTURE_END;
+		}
+		return;
+	}
+
+	if (!gs->active) {
+		gs->active = 1;
+		gs->base = gs->total = SIMILARITY_IDENTITY;
+		gs->events |= GESTURE_BEGIN;
+	}
+
+	// Touch IDs give the correspondence, so each touch is simply paired
+	// with where it was at this point
+	for (i = 0; i < dev->touches; i++) {
+		dev->touchtrack[i].gstart = dev->touchpts[i];
+		gesture_sums_add(&gs->sums, dev->touchpts[i], dev->touchpts[i]);
+	}
+}
+
+/*
+ * Loads the chord layout from a file, or compiles the built-in one if there is
+ * none, and builds the nearest-neighbour index over its chords
+ */
+static int compile_chords(struct kbd_state *state, const char *path)
+{
+	int i, n;
+
+	if (path ? layout_load(&state->layout, path, chord_anchors,
+				CHORD_SCALE) :
+			layout_build(&state->layout, default_layout,
+				sizeof(default_layout) / sizeof(default_layout[0]),
+				chord_anchors, CHORD_SCALE))
+		return 1;
+
+	n = layout_count(&state->layout);
+	struct chord_desc *descs = malloc(n * sizeof(descs[0]));
+	if (!descs) {
+		fprintf(stderr, "Failed to allocate chord index\n");
+		layout_free(&state->layout);
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		struct chord_template t;
+		layout_template(&state->layout, i, &t);
+		chord_template_describe(&t, state->layout.anchors, CHORD_SCALE,
+				&descs[i]);
+	}
+
+	int ret = chord_index_build(&state->chord_index, descs, n);
+
+	// Learn from use, starting with what was learned last time, which
+	// replaces the index as soon as it has been rebuilt
+	if (!ret && state->calib_path) {
+		state->calib = calib_create(descs, n);
+		if (!state->calib || calib_load(state->calib, state->calib_path)) {
+			fprintf(stderr, "Failed to set up calibration\n");
+			calib_destroy(state->calib);
+			state->calib = NULL;
+			chord_index_free(&state->chord_index);
+			ret = 1;
+		} else {
+			calib_rebuild(state->calib);
+		}
+	}
+
+	free(descs);
+	if (ret)
+		layout_free(&state->layout);
+	return ret;
+}
+
+/*
+ * Frees everything allocated by compile_chords
+ */
+static void free_chords(struct kbd_state *state)
+{
+	calib_destroy(state->calib);
+	chord_index_free(&state->chord_index);
+	layout_free(&state->layout);
+}
+
+/*
+ * Stops a device's chord timers
+ */
+static void cancel_chord_timers(struct kbd_state *state,
+		struct touch_device *dev)
+{
+	timers_cancel(state->timers, dev->chord.settle);
+	timers_cancel(state->timers, dev->chord.abort);
+	dev->chord.settle = -1;
+	dev->chord.abort = -1;
+}
+
+/*
+ * Follows the chord being formed as touches begin (idx < 0) and move: keeps a
+ * copy of the touches whenever there are at least as many as there have been
+ * since the first one began, and rules the chord out if a touch strays
+ */
+static void track_chord(struct kbd_state *state, struct touch_device *dev,
+		int idx)
+{
+	struct chord_state *cs = &dev->chord;
+
+	if (cs->done)
+		return;
+
+	if (idx >= 0) {
+		double dx = dev->touchpts[idx].x - dev->touchtrack[idx].down.x;
+		double dy = dev->touchpts[idx].y - dev->touchtrack[idx].down.y;
+		if (dx * dx + dy * dy > CHORD_SLOP * CHORD_SLOP) {
+			cs->done = 1;
+			cancel_chord_timers(state, dev);
+			return;
+		}
+	}
+
+	if (dev->touches < cs->npeak)
+		return;
+	if (dev->touches > CHORD_MAX_FINGERS) {
+		cs->done = 1;
+		cancel_chord_timers(state, dev);
+		return;
+	}
+
+	uint64_t now = latency_now();
+	if (!cs->npeak)
+		cs->abort = timers_add(state->timers,
+				now + CHORD_ABORT_MS * 1000000ull,
+				TIMER_ABORT, dev->deviceid, 0);
+	memcpy(cs->peak, dev->touchpts, dev->touches * sizeof(cs->peak[0]));
+	cs->npeak = dev->touches;
+	timers_cancel(state->timers, cs->settle);
+	cs->settle = timers_add(state->timers,
+			now + CHORD_SETTLE_MS * 1000000ull,
+			TIMER_SETTLE, dev->deviceid, 0);
+}
+
+/*
+ * Classifies the chord formed on a device and writes it to standard output
+ */
+static void recognise_chord(struct kbd_state *state, struct touch_device *dev)
+{
+	struct chord_state *cs = &dev->chord;
+
+	uint64_t start = latency_now();
+	struct chord_desc desc;
+	chord_describe(cs->peak, cs->npeak, CHORD_SCALE, &desc);
+
+	// The hash only knows the templates, so once learning it's the index
+	// alone which decides
+	int t = -1;
+	if (state->calib)
+		calib_take(state->calib, &state->chord_index);
+	else
+		t = layout_lookup(&state->layout, chord_key(&desc));
+
+	// Off the template's grid cell: take the nearest template if it is
+	// close, and clearly closer than any other
+	if (t < 0) {
+		float dist, margin;
+		t = chord_match(&state->chord_index, &desc, &dist, &margin);
+		if (t >= 0 && (dist > CHORD_MATCH_DIST ||
+					margin < CHORD_MATCH_MARGIN))
+			t = -1;
+	}
+	latency_record(&state->lat_chord, latency_now() - start);
+
+	cs->done = 1;
+	cancel_chord_timers(state, dev);
+	cs->last = t;
+	state->dirty = 1;
+	if (t < 0) {
+		state->stats.unmatched++;
+		return;
+	}
+
+	state->stats.chords++;
+	printf("chord %d %s\n", dev->deviceid,
+			layout_keysym(&state->layout, t));
+	fflush(stdout);
+	type_key(state, t);
+
+	// Rebuild in the background once there is enough new to go on.  If
+	// the last rebuild is still going, try again on the next chord.
+	if (state->calib && calib_add(state->calib, t, &desc)) {
+		state->stats.learned++;
+		state->calib_pending++;
+	}
+	if (state->calib_pending >= CALIB_REBUILD_EVERY &&
+			!calib_rebuild(state->calib))
+		state->calib_pending = 0;
+}
+
+/*
+ * Types the on-screen key under a new touch, if any, and starts timing how
+ * long it is held
+ */
+static void press_softkey(struct kbd_state *state, struct touch_device *dev,
+		int idx)
+{
+	const struct point *p = &dev->touchpts[idx];
+	struct touch_track *tt = &dev->touchtrack[idx];
+
+	// Keys are laid out in window coordinates
+	int key = keyboard_hit(&state->kbd, p->x, 1080 - p->y, &dev->lastkey);
+	tt->key = key;
+	if (key < 0)
+		return;
+	type_key(state, layout_count(&state->layout) + key);
+	tt->timer = timers_add(state->timers,
+			latency_now() + SOFTKEY_REPEAT_DELAY * 1000000ull,
+			TIMER_LONGPRESS, dev->deviceid, dev->touchids[idx]);
+}
+
+/*
+ * Stops a held on-screen key repeating once its touch slides off it
+ */
+static void slide_softkey(struct kbd_state *state, struct touch_device *dev,
+		int idx)
+{
+	const struct point *p = &dev->touchpts[idx];
+	struct touch_track *tt = &dev->touchtrack[idx];
+
+	if (tt->timer < 0)
+		return;
+	if (keyboard_hit(&state->kbd, p->x, 1080 - p->y, &dev->lastkey) ==
+			tt->key)
+		return;
+	timers_cancel(state->timers, tt->timer);
+	tt->timer = -1;
+}
+
+/*
+ * Acts on a timer which has come due.  Timers are cancelled when whatever
+ * they were for goes away, but the handle is checked against the one still
+ * held in case it has been replaced since.
+ */
+static void fire_timer(struct kbd_state *state, const struct timer_event *ev)
+{
+	struct touch_device *dev = state->devs[ev->deviceid];
+	struct chord_state *cs;
+	struct touch_track *tt;
+	int idx;
+
+	if (!dev)
+		return;
+	cs = &dev->chord;
+
+	switch (ev->kind) {
+		case TIMER_SETTLE:
+			if (cs->settle != ev->handle)
+				return;
+			cs->settle = -1;
+			recognise_chord(state, dev);
+			break;
 
+		case TIMER_ABORT:
+			if (cs->abort != ev->handle)
+				return;
+			cs->abort = -1;
+			cs->done = 1;
+			cancel_chord_timers(state, dev);
+			break;
 
-err_ungrab_keys:
-	ungrab_keys(state);
-err_destroy_win:
-	XDestroyWindow(state->dpy, state->win);
-	return 1;
+		case TIMER_LONGPRESS:
+		case TIMER_REPEAT:
+			idx = get_touch_index(dev, ev->id);
+			if (idx < 0)
+				return;
+			tt = &dev->touchtrack[idx];
+			if (tt->timer != ev->handle)
+				return;
+			tt->timer = -1;
+			if (tt->key < 0)
+				return;
+
+			// Keep to the repeat rate, unless we have fallen a
+			// whole interval behind
+			type_key(state, layout_count(&state->layout) + tt->key);
+			uint64_t next = ev->when +
+				SOFTKEY_REPEAT_INTERVAL * 1000000ull;
+			uint64_t now = latency_now();
+			if (next <= now)
+				next = now + SOFTKEY_REPEAT_INTERVAL * 1000000ull;
+			tt->timer = timers_add(state->timers, next,
+					TIMER_REPEAT, dev->deviceid, ev->id);
+			break;
+	}
 }
 
 /*
- * Map the main window and wait for confirmation
+ * Fires every timer which has come due, so that anything they type goes out
+ * in the same flush as the frame
  */
-static void map_window(struct kbd_state *state)
+static void run_timers(struct kbd_state *state)
 {
-	// Map everything and wait for the notify event
-	XMapWindow(state->dpy, state->win);
+	struct timer_event ev;
+	uint64_t now = latency_now();
 
-	XEvent ev;
-	while (XMaskEvent(state->dpy, StructureNotifyMask, &ev) == Success &&
-			(ev.type != MapNotify || ev.xmap.event != state->win))
-		;
+	while (timers_expire(state->timers, now, &ev))
+		fire_timer(state, &ev);
 }
 
 /*
- * Tear down everything created in create_window
+ * Feeds a touch's latest position through its smoothing filters
  */
-static void destroy_window(struct kbd_state *state)
+static void filter_touch(struct kbd_state *state, struct touch_device *dev,
+		int idx)
 {
-	ungrab_touches(state);
-	ungrab_keys(state);
-	XDestroyWindow(state->dpy, state->win);
+	struct touch_track *tt = &dev->touchtrack[idx];
+	double t = tt->time / 1000.0;
+
+	oneeuro_filter(&tt->fx, &state->filter, dev->touchpts[idx].x, t);
+	oneeuro_filter(&tt->fy, &state->filter, dev->touchpts[idx].y, t);
+	tt->batch = state->batch;
 }
 
 /*
- * Initializes drawing context
+ * Determines whether a touch update is small and soon enough after the last
+ * one we kept that it can be ignored as jitter
  */
-static int setup_draw(struct kbd_state *state)
+static int in_deadband(struct kbd_state *state, struct touch_device *dev,
+		int idx, double x, double y, uint32_t time)
 {
-	state->gc = XCreateGC(state->dpy, state->win, 0, NULL);
+	double dx = x - dev->touchpts[idx].x;
+	double dy = y - dev->touchpts[idx].y;
 
-#ifdef XFT_TEXT
-	XRenderColor xrc;
-	state->draw = XftDrawCreate(state->dpy, state->win, state->xvi.visual,
-			state->cmap);
-	if (!state->draw) {
-		fprintf(stderr, "Couldn't create Xft draw context\n");
-		goto err_free_gc;
-	}
+	return dx * dx + dy * dy < state->deadband_dist * state->deadband_dist &&
+		time - dev->touchtrack[idx].time < state->deadband_time;
+}
 
-	xrc = TEXT_COLOR;
-	if (!XftColorAllocValue(state->dpy, state->xvi.visual, state->cmap,
-				&xrc, &state->textclr)) {
-		fprintf(stderr, "Couldn't allocate Xft color\n");
-		goto err_destroy_draw;
-	}
+/*
+ * Updates the contact attributes of a touch record from whichever valuators
+ * were present in its latest event
+ */
+static void update_touch_attrs(struct touch_device *dev, int idx,
+		const double *vals, unsigned present)
+{
+	struct touch_attrs *attrs = &dev->touchattrs[idx];
+
+	if (present & (1u << VAL_PRESSURE))
+		attrs->pressure = vals[VAL_PRESSURE];
+	if (present & (1u << VAL_TOUCH_MAJOR))
+		attrs->major = vals[VAL_TOUCH_MAJOR];
+	if (present & (1u << VAL_TOUCH_MINOR))
+		attrs->minor = vals[VAL_TOUCH_MINOR];
+	if (present & (1u << VAL_ORIENTATION))
+		attrs->orientation = vals[VAL_ORIENTATION];
+}
 
-	state->font = XftFontOpenName(state->dpy, DefaultScreen(state->dpy),
-			TEXT_FONT);
-	if (!state->font) {
-		fprintf(stderr, "Couldn't load Xft font\n");
-		goto err_free_color;
-	}
-#endif
-	return 0;
+/*
+ * Decodes the valuators of interest from an event using the device's
+ * precomputed plan.  Values are packed, one for each bit set in the mask, so
+ * each value's position is the number of bits set below it.  Returns a
+ * bitmask of which entries in vals were present.
+ */
+static unsigned decode_valuators(const struct touch_device *dev,
+		const uint32_t *mask, int mask_len,
+		const xcb_input_fp3232_t *values, double *vals)
+{
+	unsigned present = 0;
+	int word = 0, base = 0;
+	int i;
 
+	for (i = 0; i < dev->nplan; i++) {
+		const struct valuator *v = &dev->vals[dev->plan[i]];
+		if (v->word >= mask_len)
+			break;
+		for (; word < v->word; word++)
+			base += __builtin_popcount(mask[word]);
+		if (!(mask[word] & v->bit))
+			continue;
+		vals[dev->plan[i]] = fp3232_to_double(values[base +
+				__builtin_popcount(mask[word] & v->below)]);
+		present |= 1u << dev->plan[i];
+	}
 
-#ifdef XFT_TEXT
-err_free_color:
-	XftColorFree(state->dpy, state->xvi.visual, state->cmap, &state->textclr);
-err_destroy_draw:
-	XftDrawDestroy(state->draw);
-err_free_gc:
-	XFreeGC(state->dpy, state->gc);
-	return 1;
-#endif
+	return present;
 }
 
 /*
- * Tears down drawing context
+ * Maps a device axis value onto a screen dimension
  */
-static void cleanup_draw(struct kbd_state *state)
+static double axis_to_screen(const struct valuator *v, double value, int size)
 {
-#ifdef XFT_TEXT
-	XftFontClose(state->dpy, state->font);
-	XftColorFree(state->dpy, state->xvi.visual, state->cmap, &state->textclr);
-	XftDrawDestroy(state->draw);
-#endif
-	XFreeGC(state->dpy, state->gc);
+	if (v->max <= v->min)
+		return value;
+	return (value - v->min) * size / (v->max - v->min);
 }
 
 /*
- * Draws the window
+ * Applies a touch begin, update or end to a device's touch table
  */
-static void update_display(struct kbd_state *state)
+static int apply_touch(struct kbd_state *state, struct touch_device *dev,
+		int type, uint32_t id, double x, double y, uint32_t time,
+		const double *vals, unsigned present)
 {
-	int i;
-	struct point c;
-#ifdef XFT_TEXT
-	char str[256];
-	Screen *scr = DefaultScreenOfDisplay(state->dpy);
-	int sheight = HeightOfScreen(scr);
-#endif
-
-	XClearWindow(state->dpy, state->win);
+	int idx;
 
-	// Draw touches
-	XSetForeground(state->dpy, state->gc, TOUCH_COLOR);
-	for (i = 0; i < state->touches; i++) {
-		XFillArc(state->dpy, state->win, state->gc,
-				state->touchpts[i].x - TOUCH_RADIUS,
-				1080 - state->touchpts[i].y - TOUCH_RADIUS,
-				2 * TOUCH_RADIUS, 2 * TOUCH_RADIUS,
-				0, 360 * 64);
-	}
+	switch (type) {
+		case XCB_INPUT_TOUCH_BEGIN:
+			// Find and record which button was touched
+			if (add_touch(dev, id, x, y, time))
+				return 1;
+			update_touch_attrs(dev, dev->touches - 1, vals, present);
+			filter_touch(state, dev, dev->touches - 1);
+			regesture(dev);
+			if (state->softkeys)
+				press_softkey(state, dev, dev->touches - 1);
+			else
+				track_chord(state, dev, -1);
+			break;
 
-	// Print calculated data
-#ifdef XFT_TEXT
-	i = snprintf(str, 256, "Touches: %d", state->touches);
-	XftDrawStringUtf8(state->draw, &state->textclr, state->font, 0, sheight - 10,
-			(XftChar8 *) str, i);
-#else
-	printf("Touches: %d\n", state->touches);
-#endif
+		case XCB_INPUT_TOUCH_END:
+			// Find which touch was released
+			idx = get_touch_index(dev, id);
+			// May have been dropped when the device shrank, or
+			// begun before we started watching
+			if (idx < 0)
+				return 0;
 
-	if (state->touches < 2)
-		return;
+			// Update touch tracking
+			timers_cancel(state->timers, dev->touchtrack[idx].timer);
+			remove_touch(dev, idx);
+			regesture(dev);
+
+			// The chord is whatever was held before the fingers
+			// started lifting
+			timers_cancel(state->timers, dev->chord.settle);
+			dev->chord.settle = -1;
+			if (dev->touches)
+				break;
+			if (!dev->chord.done && dev->chord.npeak)
+				recognise_chord(state, dev);
+			cancel_chord_timers(state, dev);
+			dev->chord.npeak = 0;
+			dev->chord.done = 0;
+			break;
 
-	XSetForeground(state->dpy, state->gc, ANALYSIS_COLOR);
+		case XCB_INPUT_TOUCH_UPDATE:
+			idx = get_touch_index(dev, id);
+			if (idx < 0)
+				return 0;
+
+			// Nothing visible changes for jitter, so skip the
+			// analysis and redraw for it
+			state->stats.updates++;
+			update_touch_attrs(dev, idx, vals, present);
+			if (in_deadband(state, dev, idx, x, y, time)) {
+				state->stats.absorbed++;
+				return 0;
+			}
 
-	// Draw convex hull and bounding box
-	struct point *hull = malloc(state->touches * sizeof(hull[0]));
-	int nhull = points_convex_hull(state->touchpts, state->touches, hull);
-	int area = (int) polygon_area(hull, nhull);
+			// Update touch position, and the gesture in constant
+			// time from how far it moved
+			struct point old = dev->touchpts[idx];
+			update_touch(dev, idx, x, y, time);
+			filter_touch(state, dev, idx);
+			if (dev->gesture.active) {
+				gesture_sums_move(&dev->gesture.sums,
+						dev->touchtrack[idx].gstart, old,
+						dev->touchpts[idx]);
+				dev->gesture.events |= GESTURE_UPDATE;
+			}
+			if (state->softkeys)
+				slide_softkey(state, dev, idx);
+			else
+				track_chord(state, dev, idx);
+			break;
 
-	for (i = 0; i < nhull - 1; i++) {
-		XDrawLine(state->dpy, state->win, state->gc, hull[i].x, 1080 - hull[i].y,
-				hull[i + 1].x, 1080 - hull[i + 1].y);
+		default:
+			return 0;
 	}
-	XDrawLine(state->dpy, state->win, state->gc, hull[i].x, 1080 - hull[i].y,
-			hull[0].x, 1080 - hull[0].y);
 
-	struct point bbox[4];
-	points_oriented_bbox(hull, nhull, bbox);
-	for (i = 0; i < 3; i++) {
-		XDrawLine(state->dpy, state->win, state->gc, bbox[i].x, 1080 - bbox[i].y,
-				bbox[i + 1].x,
-				1080 - bbox[i + 1].y);
+	// Redraw once the current batch of events has been handled
+	dev->dirty = 1;
+	state->dirty = 1;
+	return 0;
+}
+
+/*
+ * Event handling for XInput touch events delivered through our grab
+ */
+static int handle_touch_event(struct kbd_state *state,
+		xcb_ge_generic_event_t *gev)
+{
+	xcb_input_touch_begin_event_t *ev = (xcb_input_touch_begin_event_t *) gev;
+	struct touch_device *dev;
+	double x = fp1616_to_double(ev->event_x);
+	double y = 1080 - fp1616_to_double(ev->event_y);
+	double vals[NVALUATORS];
+	unsigned present;
+
+	// Touch events go straight to their device's state.  Stragglers from
+	// a device which was just removed are dropped.
+	dev = find_device(state, ev->deviceid);
+	if (!dev)
+		return 0;
+	present = decode_valuators(dev, xcb_input_touch_begin_valuator_mask(ev),
+			ev->valuators_len, xcb_input_touch_begin_axisvalues(ev),
+			vals);
+
+	if (gev->event_type == XCB_INPUT_TOUCH_BEGIN) {
+		// Bring window to top if it isn't
+		xcb_configure_window(state->conn, state->win,
+				XCB_CONFIG_WINDOW_STACK_MODE,
+				(uint32_t[]) {XCB_STACK_MODE_ABOVE});
+
+		// Claim the touch event
+		xcb_input_xi_allow_events(state->conn, XCB_CURRENT_TIME,
+				dev->deviceid, XCB_INPUT_EVENT_MODE_ACCEPT_TOUCH,
+				ev->detail, ev->event);
 	}
-	XDrawLine(state->dpy, state->win, state->gc, bbox[3].x, 1080 - bbox[3].y,
-			bbox[0].x, 1080 - bbox[0].y);
-	free(hull);
 
-	// Draw center
-	c = points_enclosing_center(state->touchpts, state->touches);
+	return apply_touch(state, dev, gev->event_type, ev->detail, x, y,
+			ev->time, vals, present);
+}
+
+/*
+ * Event handling for XInput raw touch events in passive mode.  Raw events
+ * only carry device coordinates, which are mapped across the whole screen.
+ */
+static int handle_raw_touch_event(struct kbd_state *state,
+		xcb_ge_generic_event_t *gev)
+{
+	xcb_input_raw_touch_begin_event_t *ev =
+		(xcb_input_raw_touch_begin_event_t *) gev;
+	const uint32_t *mask = xcb_input_raw_touch_begin_valuator_mask(ev);
+	const xcb_input_fp3232_t *values =
+		xcb_input_raw_touch_begin_axisvalues(ev);
+	struct touch_device *dev;
+	double vals[NVALUATORS];
+	unsigned present;
+	double x = 0, y = 0;
+	int idx;
+
+	dev = find_device(state, ev->deviceid);
+	if (!dev)
+		return 0;
+	present = decode_valuators(dev, mask, ev->valuators_len, values, vals);
+
+	// Axes left out of an update haven't moved
+	idx = get_touch_index(dev, ev->detail);
+	if (idx >= 0) {
+		x = dev->touchpts[idx].x;
+		y = dev->touchpts[idx].y;
+	}
+	if (present & (1u << VAL_X))
+		x = axis_to_screen(&dev->vals[VAL_X], vals[VAL_X], state->swidth);
+	if (present & (1u << VAL_Y))
+		y = 1080 - axis_to_screen(&dev->vals[VAL_Y], vals[VAL_Y],
+				state->sheight);
+
+	return apply_touch(state, dev, gev->event_type -
+			(XCB_INPUT_RAW_TOUCH_BEGIN - XCB_INPUT_TOUCH_BEGIN),
+			ev->detail, x, y, ev->time, vals, present);
+}
 
-	XFillRectangle(state->dpy, state->win, state->gc,
-			c.x - CENTER_RADIUS, 1080 - c.y - CENTER_RADIUS,
-			2 * CENTER_RADIUS, 2 * CENTER_RADIUS);
+/*
+ * Event handling for XInput generic events
+ */
+static int handle_xi_event(struct kbd_state *state, xcb_ge_generic_event_t *gev)
+{
+	switch (gev->event_type) {
+		case XCB_INPUT_TOUCH_BEGIN:
+		case XCB_INPUT_TOUCH_UPDATE:
+		case XCB_INPUT_TOUCH_END:
+			// Stragglers can arrive after a daemon lets go
+			if (!state->shown)
+				break;
+			return handle_touch_event(state, gev);
+		case XCB_INPUT_RAW_TOUCH_BEGIN:
+		case XCB_INPUT_RAW_TOUCH_UPDATE:
+		case XCB_INPUT_RAW_TOUCH_END:
+			// Observing pauses while a daemon is hidden
+			if (!state->shown)
+				break;
+			return handle_raw_touch_event(state, gev);
+		case XCB_INPUT_HIERARCHY:
+			handle_hierarchy_event(state,
+					(xcb_input_hierarchy_event_t *) gev);
+			break;
+		case XCB_INPUT_DEVICE_CHANGED:
+			handle_device_changed(state,
+					(xcb_input_device_changed_event_t *) gev);
+			break;
+		default:
+			fprintf(stderr, "other event %d\n", gev->event_type);
+			break;
+	}
+	return 0;
+}
 
-	// Print analysis text
+/*
+ * Follows the screen to a new size: the window is resized to match, and the
+ * on-screen keyboard laid out again and redrawn into its pixmap before the
+ * next frame
+ */
+static void handle_screen_change(struct kbd_state *state, int width,
+		int height)
+{
+	if (width == state->swidth && height == state->sheight)
+		return;
+	state->swidth = width;
+	state->sheight = height;
+	xcb_configure_window(state->conn, state->win,
+			XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+			(uint32_t[]) {width, height});
+
+	if (state->softkeys) {
+		keyboard_free(&state->kbd);
+		if (build_keyboard(state)) {
+			fprintf(stderr, "Disabling on-screen keyboard\n");
+			state->softkeys = 0;
+		}
+		state->kbd_stale = 1;
+
+		// Keys under current touches may be gone
+		int i, j;
+		for (i = 0; i < state->ndevs; i++) {
+			struct touch_device *dev = state->devlist[i];
+			dev->lastkey = -1;
+			for (j = 0; j < dev->touches; j++) {
+				timers_cancel(state->timers,
+						dev->touchtrack[j].timer);
+				dev->touchtrack[j].timer = -1;
+				dev->touchtrack[j].key = -1;
+			}
+		}
+	}
 #ifdef XFT_TEXT
-	i = snprintf(str, 256, "C = (%.1f, %.1f)   A = %d", c.x, c.y, area);
-	XftDrawStringUtf8(state->draw, &state->textclr, state->font, 0, sheight - 60,
-			(XftChar8 *) str, i);
-#else
-	printf("C = (%.1f, %.1f)\tA = %d\n", c.x, c.y, area);
+	state->text_stale = 1;
 #endif
+	state->dirty = 1;
 }
 
 /*
- * Find the index of a given touch ID in the internal array
+ * Brings a resident daemon's window up.  Nothing is waited on: grab replies
+ * are checked from the event loop, and the first frame goes out in the same
+ * flush as the map request.
  */
-static int get_touch_index(struct kbd_state *state, int id)
+static void show_window(struct kbd_state *state)
 {
 	int i;
-	for (i = 0; i < state->touches; i++)
-		if (state->touchids[i] == id)
-			return i;
-	return -1;
+
+	if (state->shown)
+		return;
+	state->shown = 1;
+
+	xcb_map_window(state->conn, state->win);
+	xcb_configure_window(state->conn, state->win,
+			XCB_CONFIG_WINDOW_STACK_MODE,
+			(uint32_t[]) {XCB_STACK_MODE_ABOVE});
+	if (!state->passive) {
+		if (grab_keys(state))
+			fprintf(stderr, "Failed to grab keys\n");
+		for (i = 0; i < state->ndevs; i++)
+			add_pending(state, PENDING_GRAB,
+					state->devlist[i]->deviceid,
+					grab_touches(state,
+						state->devlist[i]).sequence);
+	}
+	state->dirty = 1;
 }
 
 /*
- * Records a touch and its info
+ * Puts a resident daemon's window away, letting go of input and forgetting
+ * any touches in progress, while keeping everything else ready to show again
  */
-static int add_touch(struct kbd_state *state, int id, double x, double y)
+static void hide_window(struct kbd_state *state)
 {
-	// Should always have allocated enough slots for device max
-	assert(state->touches < state->nslots);
+	int i, j;
 
-	// Fill it out
-	state->touchids[state->touches] = id;
-	state->touchpts[state->touches].x = x;
-	state->touchpts[state->touches].y = y;
-	state->touches++;
-	return 0;
+	if (!state->shown)
+		return;
+	state->shown = 0;
+
+	if (!state->passive) {
+		ungrab_all_touches(state);
+		ungrab_keys(state);
+	}
+	xcb_unmap_window(state->conn, state->win);
+
+	// Their ends will never be seen, so nothing typed comes of them
+	for (i = 0; i < state->ndevs; i++) {
+		struct touch_device *dev = state->devlist[i];
+		for (j = 0; j < dev->touches; j++)
+			timers_cancel(state->timers, dev->touchtrack[j].timer);
+		dev->touches = 0;
+		regesture(dev);
+		cancel_chord_timers(state, dev);
+		dev->chord.npeak = 0;
+		dev->chord.done = 0;
+		dev->lastkey = -1;
+		dev->dirty = 1;
+	}
 }
 
 /*
- * Removes a touch record
+ * Reads the signals which control a resident daemon: SIGUSR1 shows it,
+ * SIGUSR2 hides it, and anything else shuts it down
  */
-static void remove_touch(struct kbd_state *state, int idx)
+static void handle_signals(struct kbd_state *state)
 {
-	assert(idx >= 0 && idx < state->touches);
-
-	state->touches--;
-	if (idx < state->touches) {
-		state->touchids[idx] = state->touchids[state->touches];
-		state->touchpts[idx] = state->touchpts[state->touches];
+	struct signalfd_siginfo si;
+
+	while (read(state->sigfd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+			case SIGUSR1:
+				if (!state->shown)
+					state->show_start = latency_now();
+				show_window(state);
+				break;
+			case SIGUSR2:
+				hide_window(state);
+				break;
+			default:
+				state->shutdown = 1;
+				break;
+		}
 	}
 }
 
 /*
- * Updates a touch record
+ * Dispatches a single event from the X server
  */
-static void update_touch(struct kbd_state *state, int idx, double x, double y)
+static int handle_event(struct kbd_state *state, xcb_generic_event_t *ev)
 {
-	assert(idx >= 0 && idx < state->touches);
-
-	state->touchpts[idx].x = x;
-	state->touchpts[idx].y = y;
+	xcb_ge_generic_event_t *gev = (xcb_ge_generic_event_t *) ev;
+	xcb_mapping_notify_event_t *mn = (xcb_mapping_notify_event_t *) ev;
+	xcb_configure_notify_event_t *cn;
+	XMappingEvent xme;
+
+	switch (ev->response_type & ~0x80) {
+		case 0:
+			fprintf(stderr, "X error %d\n",
+					((xcb_generic_error_t *) ev)->error_code);
+			break;
+		case XCB_GE_GENERIC:
+			// GenericEvent from XInput
+			if (gev->extension == state->xi_opcode)
+				return handle_xi_event(state, gev);
+			break;
+		case XCB_MAPPING_NOTIFY:
+			// Xlib still owns the keymap, so hand the notification
+			// over in its own format
+			xme = (XMappingEvent) {
+				.type = MappingNotify,
+				.display = state->dpy,
+				.request = mn->request,
+				.first_keycode = mn->first_keycode,
+				.count = mn->count,
+			};
+			XRefreshKeyboardMapping(&xme);
+			if (mn->request == XCB_MAPPING_KEYBOARD) {
+				ungrab_keys(state);
+				if (state->shown)
+					grab_keys(state);
+				map_keystrokes(state);
+			}
+			break;
+		case XCB_CONFIGURE_NOTIFY:
+			cn = (xcb_configure_notify_event_t *) ev;
+			if (cn->window == state->root)
+				handle_screen_change(state, cn->width,
+						cn->height);
+			break;
+		case XCB_KEY_PRESS:
+			break;
+		case XCB_KEY_RELEASE:
+			// Only grabbed key is Esc, which only puts a daemon
+			// away
+			if (state->daemon)
+				hide_window(state);
+			else
+				state->shutdown = 1;
+			break;
+		default:
+			fprintf(stderr, "regular event %d\n", ev->response_type);
+	}
+	return 0;
 }
 
 /*
- * Event handling for XInput generic events
+ * Main event handling loop.  Everything already available from the server is
+ * handled as one batch, after which the display is redrawn at most once and
+ * all resulting requests go out in a single flush.
  */
-static int handle_xi_event(struct kbd_state *state, XIDeviceEvent *ev)
+static int event_loop(struct kbd_state *state)
 {
-	int idx;
+	xcb_generic_event_t *ev, *queued = NULL;
+	uint64_t start;
+	uint64_t expiries;
+	struct pollfd pfd[3] = {
+		{
+			.fd = xcb_get_file_descriptor(state->conn),
+			.events = POLLIN,
+		},
+		{
+			.fd = timers_fd(state->timers),
+			.events = POLLIN,
+		},
+		{
+			// Left at -1, and so ignored, unless running as a
+			// daemon
+			.fd = state->sigfd,
+			.events = POLLIN,
+		},
+	};
+
+	while (!state->shutdown) {
+		state->batch++;
+		start = state->batch_start = 0;
+		while ((ev = queued ? queued : xcb_poll_for_event(state->conn))) {
+			queued = NULL;
+			if (!start)
+				start = state->batch_start = latency_now();
+			handle_event(state, ev);
+			free(ev);
+		}
+		if (xcb_connection_has_error(state->conn)) {
+			fprintf(stderr, "Lost connection to display\n");
+			return 1;
+		}
+		poll_pending(state);
+		if (pfd[2].revents & POLLIN)
+			handle_signals(state);
+
+		// Timers due by now are run whether or not the timerfd has
+		// been seen to fire yet
+		if (pfd[1].revents & POLLIN)
+			while (read(pfd[1].fd, &expiries, sizeof(expiries)) > 0)
+				;
+		run_timers(state);
+
+		int drawn = state->dirty;
+		if (state->dirty) {
+			update_display(state);
+			state->dirty = 0;
+			state->stats.frames++;
+		}
 
-	switch (ev->evtype) {
-		case XI_TouchBegin:
-			// Bring window to top if it isn't
-			XRaiseWindow(state->dpy, state->win);
+		// Xft still queues through Xlib, which passes everything on
+		// to XCB in order when it flushes
+		XFlush(state->dpy);
+
+		// Time from the first event of the batch reaching us to its
+		// frame being sent off
+		if (drawn && start)
+			latency_record(&state->lat_frame, latency_now() - start);
+		if (state->key_start) {
+			latency_record(&state->lat_key,
+					latency_now() - state->key_start);
+			state->key_start = 0;
+		}
+		if (drawn && state->show_start) {
+			latency_record(&state->lat_show,
+					latency_now() - state->show_start);
+			state->show_start = 0;
+		}
 
-			// Claim the touch event
-			XIAllowTouchEvents(state->dpy, state->input_dev,
-					ev->detail, ev->event, XIAcceptTouch);
+		// Reading replies and flushing can both leave events or
+		// replies queued inside XCB, where they no longer make the
+		// socket readable, so go round again rather than sleep on them
+		if (!state->shutdown && ((queued =
+					xcb_poll_for_queued_event(state->conn)) ||
+					poll_pending(state))) {
+			pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+			continue;
+		}
 
-			// Find and record which button was touched
-			if (add_touch(state, ev->detail, ev->event_x, 1080 - ev->event_y))
-				return 1;
-			break;
+		// Sleep until there are events or the next timer is due
+		timers_arm(state->timers);
+		if (!state->shutdown && poll(pfd, 3, -1) < 0 &&
+				errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+	}
 
-		case XI_TouchEnd:
-			// Find which touch was released
-			idx = get_touch_index(state, ev->detail);
-			// Should always have recorded this touch
-			assert(idx >= 0);
+	return 0;
+}
 
-			// Update touch tracking
-			remove_touch(state, idx);
-			break;
+/*
+ * Reports how much work was saved by the motion deadband
+ */
+static void print_stats(struct kbd_state *state)
+{
+	const struct stats *st = &state->stats;
+	char name[64];
+	int i;
 
-		case XI_TouchUpdate:
-			idx = get_touch_index(state, ev->detail);
-			// Should always have recorded this touch
-			assert(idx >= 0);
+	fprintf(stderr, "%llu touch updates, %llu absorbed as jitter (%.1f%%)\n",
+			st->updates, st->absorbed,
+			st->updates ? 100.0 * st->absorbed / st->updates : 0.0);
+	fprintf(stderr, "%llu frames drawn\n", st->frames);
+	snprintf(name, sizeof(name), "event to flush (%s)",
+			path_names[state->path]);
+	latency_report(&state->lat_frame, name, stderr);
+	for (i = 0; i < NRESULTS; i++) {
+		unsigned long long reads = st->reused[i] + st->computed[i];
+		fprintf(stderr, "%s: %llu computed, %llu reused (%.1f%%)\n",
+				result_names[i], st->computed[i], st->reused[i],
+				reads ? 100.0 * st->reused[i] / reads : 0.0);
+	}
+	fprintf(stderr, "%llu chords recognised, %llu unmatched\n",
+			st->chords, st->unmatched);
+	if (state->calib)
+		fprintf(stderr, "%llu chords learned from\n", st->learned);
+	latency_report(&state->lat_chord, "chord recognition", stderr);
+	latency_report(&state->lat_key, "chord to keystroke", stderr);
+	if (state->daemon)
+		latency_report(&state->lat_show, "signal to first frame", stderr);
+}
 
-			// Update touch position
-			update_touch(state, idx, ev->event_x, 1080 - ev->event_y);
-			break;
+/*
+ * Blocks the signals which control a resident daemon so they can be read from
+ * a signalfd instead.  Threads inherit the mask, so this has to happen before
+ * any are started.
+ */
+static int block_signals(struct kbd_state *state)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+		perror("sigprocmask");
+		return 1;
+	}
 
-		default:
-			fprintf(stderr, "other event %d\n", ev->evtype);
-			break;
+	state->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (state->sigfd < 0) {
+		perror("signalfd");
+		return 1;
 	}
-	update_display(state);
 	return 0;
 }
 
 /*
- * Main event handling loop
+ * Reports how long each phase of startup took
  */
-static int event_loop(struct kbd_state *state)
+static void print_startup(struct kbd_state *state)
 {
-	XEvent ev;
-	XGenericEventCookie *cookie = &ev.xcookie;
+	uint64_t total = 0;
+	int i;
 
-	while (!state->shutdown && XNextEvent(state->dpy, &ev) == Success) {
-		if (ev.type == GenericEvent &&
-				cookie->extension == state->xi_opcode &&
-				XGetEventData(state->dpy, cookie)) {
-			// GenericEvent from XInput
-			handle_xi_event(state, cookie->data);
-			XFreeEventData(state->dpy, cookie);
-		} else {
-			// Regular event type
-			switch (ev.type) {
-				case MappingNotify:
-					XRefreshKeyboardMapping(&ev.xmapping);
-					if (ev.xmapping.request == MappingKeyboard) {
-						ungrab_keys(state);
-						grab_keys(state);
-					}
-					break;
-				case KeyPress:
-					break;
-				case KeyRelease:
-					// Only grabbed key is Esc
-					state->shutdown = 1;
-					break;
-				default:
-					fprintf(stderr, "regular event %d\n", ev.type);
-			}
-		}
+	fprintf(stderr, "startup:");
+	for (i = 0; i < NPHASES; i++) {
+		fprintf(stderr, " %s %.2fms", phase_names[i],
+				state->phases[i] / 1e6);
+		total += state->phases[i];
 	}
+	fprintf(stderr, ", total %.2fms\n", total / 1e6);
+#ifdef XFT_TEXT
+	fprintf(stderr, "font matched in %.2fms alongside\n",
+			state->font_time / 1e6);
+#endif
+}
 
-	return 0;
+/*
+ * Prints command-line usage
+ */
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-DknopP] [-d dist] [-t ms] [-l layout] "
+			"[-c file] [-w words] [device-id]\n"
+			"  -c  learn the user's chords, keeping them in a file\n"
+			"  -D  stay resident but hidden, shown by SIGUSR1 and "
+			"hidden by SIGUSR2\n"
+			"  -k  type on an on-screen keyboard instead of chords\n"
+			"  -l  read the chord layout from a file\n"
+			"  -n  recognise chords without typing them\n"
+			"  -o  under a compositor, draw in its overlay window\n"
+			"  -p  observe raw touches passively instead of grabbing\n"
+			"  -P  draw touches where reported, without prediction\n"
+			"  -d  ignore movements smaller than dist pixels (default %g)\n"
+			"  -t  for at most ms milliseconds at a time (default %d)\n"
+			"  -w  suggest completions from a word graph made by mkdawg\n",
+			argv0, DEADBAND_DIST, DEADBAND_TIME);
 }
 
 /*
@@ -494,81 +3348,255 @@ static int event_loop(struct kbd_state *state)
 int main(int argc, char **argv)
 {
 	int ret = 0;
+	int opt;
+	const char *layout = NULL;
+	const char *words = NULL;
 
 	struct kbd_state state;
-	state.shutdown = 0;
+	memset(&state, 0, sizeof(state));
+	state.deadband_dist = DEADBAND_DIST;
+	state.deadband_time = DEADBAND_TIME;
+	state.predict = 1;
+	state.typing = 1;
+	state.sigfd = -1;
+	state.filter = (struct oneeuro_params) {
+		.mincutoff = ONEEURO_MINCUTOFF,
+		.beta = ONEEURO_BETA,
+		.dcutoff = ONEEURO_DCUTOFF,
+	};
+
+	while ((opt = getopt(argc, argv, "DknopPd:t:l:c:w:")) != -1) {
+		switch (opt) {
+			case 'c':
+				state.calib_path = optarg;
+				break;
+			case 'D':
+				state.daemon = 1;
+				break;
+			case 'k':
+				state.softkeys = 1;
+				break;
+			case 'l':
+				layout = optarg;
+				break;
+			case 'n':
+				state.typing = 0;
+				break;
+			case 'o':
+				state.overlay = 1;
+				break;
+			case 'p':
+				state.passive = 1;
+				break;
+			case 'P':
+				state.predict = 0;
+				break;
+			case 'd':
+				state.deadband_dist = atof(optarg);
+				break;
+			case 't':
+				state.deadband_time = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				words = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
 
-	// Open display
+	// Everything but a daemon is shown from the start
+	state.phase_mark = latency_now();
+	state.shown = !state.daemon;
+	if (state.daemon && block_signals(&state)) {
+		ret = 1;
+		goto out_close_signals;
+	}
+#ifdef XFT_TEXT
+	start_font_match(&state);
+#endif
+
+	// Map the word graph, and load the chord layout and its lookup tables
+	if (words && dawg_open(&state.dawg, words)) {
+		ret = 1;
+		goto out_join_font;
+	}
+	if (compile_chords(&state, layout)) {
+		ret = 1;
+		goto out_close_words;
+	}
+
+	state.timers = timers_create(MAX_TIMERS, latency_now());
+	if (!state.timers) {
+		fprintf(stderr, "Failed to set up timers\n");
+		ret = 1;
+		goto out_free_chords;
+	}
+	mark_phase(&state, PHASE_LAYOUT);
+
+	// Open display, and share its connection with XCB for the event path
 	state.dpy = XOpenDisplay(NULL);
 	if (!state.dpy) {
 		fprintf(stderr, "Could not open display\n");
-		return 1;
+		ret = 1;
+		goto out_destroy_timers;
+	}
+	state.conn = XGetXCBConnection(state.dpy);
+	XSetEventQueueOwner(state.dpy, XCBOwnsEventQueue);
+	state.root = DefaultRootWindow(state.dpy);
+	xcb_prefetch_extension_data(state.conn, &xcb_input_id);
+	xcb_prefetch_extension_data(state.conn, &xcb_test_id);
+	if (state.overlay)
+		xcb_prefetch_extension_data(state.conn, &xcb_composite_id);
+	state.swidth = WidthOfScreen(DefaultScreenOfDisplay(state.dpy));
+	state.sheight = HeightOfScreen(DefaultScreenOfDisplay(state.dpy));
+
+	// Lay out the on-screen keyboard for this screen, and look up what
+	// every chord and key types
+	if (state.softkeys && build_keyboard(&state)) {
+		ret = 1;
+		goto out_close;
+	}
+	state.kbd_stale = 1;
+	if (init_keystrokes(&state)) {
+		ret = 1;
+		goto out_close;
 	}
 
 	// Ensure we have XInput...
-	int event, error;
-	if (!XQueryExtension(state.dpy, "XInputExtension", &state.xi_opcode,
-				&event, &error)) {
+	const xcb_query_extension_reply_t *ext;
+	ext = xcb_get_extension_data(state.conn, &xcb_input_id);
+	if (!ext || !ext->present) {
 		ret = 1;
 		fprintf(stderr, "Server does not support XInput\n");
 		goto out_close;
 	}
+	state.xi_opcode = ext->major_opcode;
+
+	// Chords are typed through XTest, when the server has it
+	if (state.typing) {
+		ext = xcb_get_extension_data(state.conn, &xcb_test_id);
+		if (!ext || !ext->present) {
+			fprintf(stderr, "Server does not support XTest, "
+					"chords will not be typed\n");
+			state.typing = 0;
+		}
+	}
+	map_keystrokes(&state);
+	mark_phase(&state, PHASE_DISPLAY);
+
+	// Ask for the XInput version and the devices together.  The server
+	// handles requests in order, so the version is settled before the
+	// devices are looked at.
+	int id = (optind < argc) ? atoi(argv[optind]) : XCB_INPUT_DEVICE_ALL;
+	xcb_input_xi_query_version_cookie_t vcookie;
+	xcb_input_xi_query_version_reply_t *version;
+	xcb_input_xi_query_device_cookie_t dcookie;
+	vcookie = xcb_input_xi_query_version(state.conn, 2, 2);
+	dcookie = query_touch_devices(&state, id);
+
+	// Get visual and colormap for transparent windows while the replies
+	// are on their way, since the visuals came with the connection
+	ret = !XMatchVisualInfo(state.dpy, DefaultScreen(state.dpy),
+				32, TrueColor, &state.xvi);
+	if (ret) {
+		fprintf(stderr, "Couldn't find 32-bit visual\n");
+		xcb_discard_reply(state.conn, vcookie.sequence);
+		xcb_discard_reply(state.conn, dcookie.sequence);
+		goto out_close;
+	}
+	state.cmap = XCreateColormap(state.dpy, DefaultRootWindow(state.dpy),
+			state.xvi.visual, AllocNone);
 
 	// ... in particular, XInput version 2.2
-	int major = 2, minor = 2;
-	XIQueryVersion(state.dpy, &major, &minor);
-	if (major * 1000 + minor < 2002) {
+	version = xcb_input_xi_query_version_reply(state.conn, vcookie, NULL);
+	if (!version || version->major_version * 1000 +
+			version->minor_version < 2002) {
+		free(version);
+		xcb_discard_reply(state.conn, dcookie.sequence);
 		ret = 1;
 		fprintf(stderr, "Server does not support XInput 2.2\n");
-		goto out_close;
+		goto out_free_cmap;
 	}
+	free(version);
 
-	// Get a specific device if given, otherwise find anything capable of
+	// Track a specific device if given, otherwise anything capable of
 	// direct-style touch input
-	int id = (argc > 1) ? atoi(argv[1]) : XIAllDevices;
-	ret = init_touch_device(&state, id);
+	intern_valuator_labels(&state);
+	ret = init_touch_devices(&state, dcookie);
 	if (ret)
-		goto out_close;
+		goto out_destroy_touch;
 
-	// Get visual and colormap for transparent windows
-	ret = !XMatchVisualInfo(state.dpy, DefaultScreen(state.dpy),
-				32, TrueColor, &state.xvi);
-	if (ret) {
-		fprintf(stderr, "Couldn't find 32-bit visual\n");
+	// Analyse devices in parallel when several are busy at once
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = (state.ndevs < ncpus ? state.ndevs : ncpus) - 1;
+	state.workers = workers_create(nthreads > 0 ? nthreads : 0);
+	if (!state.workers) {
+		ret = 1;
+		fprintf(stderr, "Failed to start worker threads\n");
 		goto out_destroy_touch;
 	}
-
-	state.cmap = XCreateColormap(state.dpy, DefaultRootWindow(state.dpy),
-			state.xvi.visual, AllocNone);
+	mark_phase(&state, PHASE_DEVICES);
 
 	// Create main window and keyboard buttons
 	ret = create_window(&state);
 	if (ret) {
 		fprintf(stderr, "Failed to create windows\n");
-		goto out_free_cmap;
+		goto out_stop_workers;
 	}
+	select_device_events(&state);
+	mark_phase(&state, PHASE_WINDOW);
 
 	// Set up a GC and Xft stuff
 	ret = setup_draw(&state);
 	if (ret)
 		goto out_destroy_window;
+	mark_phase(&state, PHASE_DRAW);
 
-	// Display the window
-	map_window(&state);
+	// Display the window.  A daemon stays unmapped, but still draws once so
+	// the keyboard and text are rendered ahead of being shown.
+	if (state.shown)
+		map_window(&state);
 	update_display(&state);
+	XFlush(state.dpy);
+	mark_phase(&state, PHASE_FIRST_FRAME);
+	print_startup(&state);
 
 	ret = event_loop(&state);
+	print_stats(&state);
+	if (state.calib)
+		calib_save(state.calib, state.calib_path);
 
 	// Clean everything up
 	cleanup_draw(&state);
 out_destroy_window:
 	destroy_window(&state);
+out_stop_workers:
+	workers_destroy(state.workers);
+out_destroy_touch:
+	destroy_touch_devices(&state);
 out_free_cmap:
 	XFreeColormap(state.dpy, state.cmap);
-out_destroy_touch:
-	destroy_touch_device(&state);
 out_close:
 	XCloseDisplay(state.dpy);
+	free_keystrokes(&state);
+	keyboard_free(&state.kbd);
+out_destroy_timers:
+	timers_destroy(state.timers);
+out_free_chords:
+	free_chords(&state);
+out_close_words:
+	dawg_close(&state.dawg);
+out_join_font:
+#ifdef XFT_TEXT
+	wait_font_match(&state);
+	if (state.font_pattern)
+		FcPatternDestroy(state.font_pattern);
+#endif
+out_close_signals:
+	if (state.sigfd >= 0)
+		close(state.sigfd);
 
 	return ret;
 }
@@ -4,11 +4,24 @@
 #include <stdint.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <xcb/xcb.h>
 #ifdef XFT_TEXT
+#include <pthread.h>
 #include <X11/Xft/Xft.h>
 #endif
 
 #include "geometry.h"
+#include "filter.h"
+#include "latency.h"
+#include "history.h"
+#include "gesture.h"
+#include "chord.h"
+#include "layout.h"
+#include "softkeys.h"
+#include "timers.h"
+#include "calib.h"
+#include "assign.h"
+#include "dawg.h"
 
 #define TOUCH_RADIUS 50
 #define CENTER_RADIUS 30
@@ -26,26 +39,466 @@
 
 #define TEXT_FONT "Consolas:pixelsize=50"
 
+// Status text is kept in a pixmap of TEXT_LINES lines TEXT_PITCH pixels apart
+// up from the bottom of the screen, each of at most TEXT_MAX characters, and
+// only the characters which change are redrawn
+#define TEXT_LINES 16
+#define TEXT_PITCH 50
+#define TEXT_MAX 128
+
+// Touch updates which move less than DEADBAND_DIST pixels within
+// DEADBAND_TIME milliseconds of the last one kept are ignored as jitter
+#define DEADBAND_DIST 1.0
+#define DEADBAND_TIME 100
+
+// Touch markers are smoothed with a One-Euro filter and drawn ahead of the
+// last report by the measured drawing latency plus PREDICT_EXTRA_MS
+#define ONEEURO_MINCUTOFF 1.0
+#define ONEEURO_BETA 0.007
+#define ONEEURO_DCUTOFF 1.0
+#define PREDICT_EXTRA_MS 8
+
+// Touches joined by a chain of touches each closer than CLUSTER_DIST pixels
+// to the next are taken to belong to the same hand
+#define CLUSTER_DIST 300
+
+// A hand's speed and acceleration are taken over the last MOTION_SAMPLES
+// samples of each of its touches, and its path over all of their history
+#define MOTION_SAMPLES 8
+
+// Fewest touches which make up a pan/pinch/rotate gesture
+#define GESTURE_MIN_TOUCHES 2
+
+// Chords are described in steps of CHORD_SCALE pixels, and recognised when
+// all fingers lift or once the touches have stayed put for CHORD_SETTLE_MS.
+// A touch straying more than CHORD_SLOP pixels rules the chord out.
+#define CHORD_SCALE 40
+#define CHORD_SETTLE_MS 300
+#define CHORD_SLOP 40
+
+// Chords still held after CHORD_ABORT_MS without settling are given up on
+#define CHORD_ABORT_MS 2000
+
+// Chords missing every template's hash cell take the nearest template within
+// CHORD_MATCH_DIST steps, if the next nearest is CHORD_MATCH_MARGIN further
+#define CHORD_MATCH_DIST 1.5
+#define CHORD_MATCH_MARGIN 0.5
+
+// With -c, the chord index is rebuilt from what has been learned after every
+// CALIB_REBUILD_EVERY chords learned from
+#define CALIB_REBUILD_EVERY 8
+
+// Hand model for the chord layout: where the thumb to little finger of a
+// relaxed right hand rest, in pixels
+#define CHORD_ANCHORS { \
+		{0, 0}, \
+		{90, 130}, \
+		{170, 160}, \
+		{250, 140}, \
+		{320, 90}, \
+	}
+
+// Built-in chord layout, used without -l: finger masks (thumb = 1 ... little = 16) and the
+// keysyms they type.  Chords differing only by where the hand is, like any
+// two single fingers, can't be told apart, so the layout leaves them out.
+#define CHORD_LAYOUT { \
+		{0x01, "space"}, \
+		{0x03, "e"}, \
+		{0x05, "t"}, \
+		{0x06, "a"}, \
+		{0x07, "o"}, \
+		{0x09, "i"}, \
+		{0x0b, "n"}, \
+		{0x0d, "s"}, \
+		{0x0e, "h"}, \
+		{0x0f, "r"}, \
+		{0x13, "d"}, \
+		{0x15, "l"}, \
+		{0x16, "u"}, \
+		{0x17, "c"}, \
+		{0x19, "m"}, \
+		{0x1b, "BackSpace"}, \
+		{0x1d, "w"}, \
+		{0x1e, "Return"}, \
+		{0x1f, "f"}, \
+	}
+
+// With -w, this many completions of the word being typed are shown
+#define WORD_SUGGESTIONS 3
+
+// On-screen keyboard for -k: rows of keysyms across the bottom SOFTKEY_HEIGHT
+// of the screen, with the keys of each row sharing its width equally
+#define SOFTKEY_HEIGHT 0.4
+#define SOFTKEY_GAP 3
+#define SOFTKEY_COLOR 0xa0303436
+#define SOFTKEY_PRESSED_COLOR TOUCH_COLOR
+#define SOFTKEY_ROWS { \
+		"q w e r t y u i o p", \
+		"a s d f g h j k l", \
+		"z x c v b n m BackSpace", \
+		"space Return", \
+	}
+
+// On-screen keys held for SOFTKEY_REPEAT_DELAY milliseconds start repeating
+// every SOFTKEY_REPEAT_INTERVAL
+#define SOFTKEY_REPEAT_DELAY 500
+#define SOFTKEY_REPEAT_INTERVAL 50
+
+// XInput device IDs are small; the server hands out fewer than this
+#define MAX_DEVICES 128
+
+// Timers which can be pending at once: a few per touch and per device
+#define MAX_TIMERS 4096
+
+// Replies which can be outstanding at once before we block on one
+#define MAX_PENDING 32
+
+/*
+ * Request whose reply is handled asynchronously from the event loop
+ */
+enum pending_type {
+	PENDING_QUERY,
+	PENDING_GRAB,
+};
+
+struct pending_reply {
+	unsigned int sequence;
+	enum pending_type type;
+	int deviceid;
+};
+
+/*
+ * What a timer is for.  Chord timers are keyed by device, and key timers by
+ * touch ID.
+ */
+enum timer_kind {
+	TIMER_SETTLE,
+	TIMER_ABORT,
+	TIMER_LONGPRESS,
+	TIMER_REPEAT,
+};
+
+/*
+ * Valuators decoded from touch events
+ */
+enum valuator_id {
+	VAL_X,
+	VAL_Y,
+	VAL_PRESSURE,
+	VAL_TOUCH_MAJOR,
+	VAL_TOUCH_MINOR,
+	VAL_ORIENTATION,
+	NVALUATORS
+};
+
+/*
+ * Where a device reports one of the decoded valuators: its number, the mask
+ * word and bit for that number, the mask of lower bits in the same word, and
+ * the axis range
+ */
+struct valuator {
+	int number;
+	int word;
+	uint32_t bit;
+	uint32_t below;
+	double min, max;
+};
+
+/*
+ * Per-contact attributes reported through valuators, in device units
+ */
+struct touch_attrs {
+	double pressure;
+	double major, minor;
+	double orientation;
+};
+
+/*
+ * Per-touch state carried between events
+ */
+struct touch_track {
+	uint32_t time;
+	unsigned long batch;
+	struct oneeuro fx, fy;
+	struct point gstart;
+	struct point down;
+	int key;
+	int timer;
+	int cluster;
+	int moved;
+	int finger;
+	int hand;
+};
+
+/*
+ * Analysis results for a cluster, which are only worked out again when what
+ * they depend on has changed
+ */
+enum cluster_result {
+	RESULT_HULL,
+	RESULT_AREA,
+	RESULT_BBOX,
+	RESULT_CENTER,
+	RESULT_FINGERS,
+	NRESULTS,
+};
+
+/*
+ * How frames get to the screen: straight there, through a compositor's
+ * repaint, or blended by the server into the compositor's overlay window
+ */
+enum present_path {
+	PATH_DIRECT,
+	PATH_COMPOSITED,
+	PATH_OVERLAY,
+	NPATHS,
+};
+
+/*
+ * Stages of startup, timed separately so slow starts can be pinned down
+ */
+enum startup_phase {
+	PHASE_LAYOUT,
+	PHASE_DISPLAY,
+	PHASE_DEVICES,
+	PHASE_WINDOW,
+	PHASE_DRAW,
+	PHASE_FONT_WAIT,
+	PHASE_FIRST_FRAME,
+	NPHASES,
+};
+
+/*
+ * Touches taken to be one hand, with their analysis results.  The label stays
+ * with the hand for as long as it keeps most of its touches.
+ *
+ * The shape version goes up whenever the hull may have changed, and the
+ * membership version whenever touches join or leave.  Each result records in
+ * at the version of what it depends on when it was computed: the hull the
+ * shape, and everything else the hull, except that the fingers also depend
+ * on membership.  Which finger each touch is goes in its touch_track; order
+ * holds the IDs of the touches around the hull, starting from the lowest,
+ * when that was decided.
+ */
+struct touch_cluster {
+	int label;
+	int n;
+	struct point *pts;
+	int *members;
+	unsigned long shape;
+	unsigned long membership;
+	unsigned long at[NRESULTS];
+	unsigned long fingers_membership;
+	struct point *hull;
+	int *hullids;
+	int nhull;
+	int area;
+	struct point bbox[4];
+	struct point center;
+	int *order;
+	int norder;
+	struct assign_state assign;
+	char fingers[ASSIGN_MAX + 1];
+	double speed;
+	double accel;
+	double path;
+};
+
+/*
+ * Gesture events raised since they were last emitted
+ */
+enum gesture_event {
+	GESTURE_BEGIN = 1,
+	GESTURE_UPDATE = 2,
+	GESTURE_END = 4,
+};
+
+/*
+ * Pan/pinch/rotate tracking for one device.  The sums cover the current set of
+ * touches; base holds what earlier sets of touches in the same gesture did.
+ */
+struct gesture_state {
+	int active;
+	int events;
+	struct gesture_sums sums;
+	struct similarity base;
+	struct similarity total;
+	struct similarity final;
+};
+
+/*
+ * Chord being formed on a device: the touches as they were when there were
+ * most of them, timers for when they count as settled and when the chord is
+ * given up on, and whether it has been recognised or ruled out already
+ */
+struct chord_state {
+	struct point peak[CHORD_MAX_FINGERS];
+	int npeak;
+	int done;
+	int settle;
+	int abort;
+	int last;
+};
+
+/*
+ * How to type a keysym: the keycode which produces it, and whether Shift has
+ * to be held for it
+ */
+struct keystroke {
+	KeySym keysym;
+	xcb_keycode_t code;
+	int shift;
+};
+
+/*
+ * Work counters, reported on exit
+ */
+struct stats {
+	unsigned long long updates;
+	unsigned long long absorbed;
+	unsigned long long frames;
+	unsigned long long chords;
+	unsigned long long unmatched;
+	unsigned long long learned;
+	unsigned long long reused[NRESULTS];
+	unsigned long long computed[NRESULTS];
+};
+
+/*
+ * Touch table and analysis results for a single touch device
+ */
+struct touch_device {
+	int deviceid;
+	struct point *touchpts;
+	int *touchids;
+	struct touch_attrs *touchattrs;
+	struct touch_track *touchtrack;
+	struct touch_history **touchhist;
+	struct touch_history *histpool;
+	int nslots;
+	int touches;
+	int dirty;
+
+	// Valuator decoding plan, in increasing valuator number
+	struct valuator vals[NVALUATORS];
+	int plan[NVALUATORS];
+	int nplan;
+
+	// Touches grouped into hands, each with its own analysis results.
+	// Clusters own fixed slices of clbuf and clidx; groups and work are
+	// scratch space for the analysis.  Fingers are told apart by matching
+	// touches to the anchors of the hand model.
+	struct touch_cluster *clusters;
+	int nclusters;
+	int nextlabel;
+	struct point *clbuf;
+	int *clidx;
+	const struct point *anchors;
+	int *groups;
+	struct point *work;
+
+	// Analysis work done since last folded into the totals, counted here
+	// so devices analysed in parallel don't share counters
+	unsigned long long reused[NRESULTS];
+	unsigned long long computed[NRESULTS];
+
+	struct gesture_state gesture;
+	struct chord_state chord;
+	int lastkey;
+};
+
+/*
+ * Line of status text: its characters and, once drawn, where each one starts
+ * and where the last one ends
+ */
+struct text_line {
+	char str[TEXT_MAX];
+	int len;
+	int x[TEXT_MAX + 1];
+};
+
 /*
  * Main application state structure
  */
 struct kbd_state {
 	Display *dpy;
+	xcb_connection_t *conn;
+	xcb_window_t root;
 	XVisualInfo xvi;
 	Colormap cmap;
 	Window win;
-	GC gc;
+	xcb_window_t overlay_win;
+	int overlay;
+	int path;
+	int swidth, sheight;
+	xcb_gcontext_t gc;
 #ifdef XFT_TEXT
 	XftFont *font;
 	XftDraw *draw;
 	XftColor textclr;
+	FT_UInt glyphs[128];
+	int advances[128];
+	xcb_pixmap_t text_pixmap;
+	XftDraw *text_draw;
+	struct text_line text[TEXT_LINES];
+	int text_lines;
+	int text_stale;
+	pthread_t font_thread;
+	int font_started;
+	FcPattern *font_pattern;
+	uint64_t font_time;
 #endif
-	struct point *touchpts;
-	int *touchids;
-	int nslots;
-	int touches;
+	struct touch_device *devs[MAX_DEVICES];
+	struct touch_device *devlist[MAX_DEVICES];
+	int ndevs;
+	int device_filter;
+	struct pending_reply pending[MAX_PENDING];
+	int npending;
+	struct workers *workers;
+	struct timers *timers;
+	xcb_arc_t *arcs;
+	xcb_point_t *lines;
+	xcb_rectangle_t *rects;
+	int maxslots;
 	int xi_opcode;
-	int input_dev;
+	xcb_atom_t val_labels[NVALUATORS];
+	int passive;
+	double deadband_dist;
+	uint32_t deadband_time;
+	struct stats stats;
+	struct latency_hist lat_frame;
+	struct latency_hist lat_chord;
+	struct layout layout;
+	struct chord_index chord_index;
+	struct calib *calib;
+	const char *calib_path;
+	int calib_pending;
+	struct keystroke *keys;
+	int nkeys;
+	int softkeys;
+	struct keyboard kbd;
+	xcb_pixmap_t kbd_pixmap;
+	int kbd_stale;
+	xcb_keycode_t shiftcode;
+	int typing;
+	uint64_t batch_start;
+	uint64_t key_start;
+	struct latency_hist lat_key;
+	struct latency_hist lat_show;
+	uint64_t show_start;
+	int daemon;
+	int shown;
+	int sigfd;
+	uint64_t phase_mark;
+	uint64_t phases[NPHASES];
+	struct dawg dawg;
+	struct dawg_cursor cursor;
+	char suggest[DAWG_MAX_RESULTS][DAWG_MAX_WORD + 1];
+	int nsuggest;
+	int predict;
+	struct oneeuro_params filter;
+	unsigned long batch;
+	int dirty;
 	int shutdown;
 };
 
@@ -0,0 +1,247 @@
+/*
+ * Chord recognition
+ *
+ *
+ * A chord is described by its touches in the frame of their minimum oriented
+ * bounding box: origin at the centre of the box, u along its longer side
+ * (pointing right on screen, so the description survives small rotations of
+ * the hand) and v across it.  Each coordinate is rounded to a multiple of the
+ * scale, and the rounded pairs are sorted and packed with the touch count into
+ * a 64-bit key.  Templates are described the same way from the fingers of a
+ * hand model, and the layout maps keys to chords through a perfect hash, so
+ * recognising a chord takes one hull, one box and one lookup, none of which
+ * depend on the size of the layout.
+ *
+ * Touches which land across a rounding boundary from their template miss the
+ * hash, so the unrounded descriptions are also kept in a nearest-neighbour
+ * index.  Templates are grouped by finger count and stored coordinate by
+ * coordinate, so the distances to every template of a group are computed by
+ * simple loops over contiguous arrays, which the compiler vectorises.  With
+ * at most ten coordinates and a few hundred templates this beats a tree, whose
+ * pruning does little in that many dimensions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "chord.h"
+
+// Bits per packed coordinate, and the offset which makes it unsigned
+#define COORD_BITS 6
+#define COORD_BIAS (1 << (COORD_BITS - 1))
+
+/*
+ * Rounds a coordinate to a whole number of steps and biases it into the range
+ * of a packed field
+ */
+static unsigned quantise(float v)
+{
+	long q = lroundf(v) + COORD_BIAS;
+	if (q < 0)
+		return 0;
+	if (q >= 1 << COORD_BITS)
+		return (1 << COORD_BITS) - 1;
+	return q;
+}
+
+/*
+ * Describes a set of touches as their coordinates in the frame of their
+ * oriented bounding box, in multiples of the scale, sorted along the box.  Sets
+ * with too few or too many touches to be a chord get n = 0.
+ */
+void chord_describe(const struct point *pts, int n, double scale,
+		struct chord_desc *d)
+{
+	struct point hull[CHORD_MAX_FINGERS];
+	struct point work[3 * CHORD_MAX_FINGERS];
+	struct point rect[4];
+	int i, j;
+
+	d->n = 0;
+	if (n < 1 || n > CHORD_MAX_FINGERS)
+		return;
+
+	// A lone touch has no frame of its own
+	struct point c = pts[0];
+	struct point u = POINT(1, 0);
+	if (n > 1) {
+		int nhull = points_convex_hull(pts, n, hull, work);
+		points_oriented_bbox(hull, nhull, rect);
+		c = POINT((rect[0].x + rect[2].x) / 2,
+				(rect[0].y + rect[2].y) / 2);
+
+		double ax = rect[1].x - rect[0].x, ay = rect[1].y - rect[0].y;
+		double bx = rect[2].x - rect[1].x, by = rect[2].y - rect[1].y;
+		if (bx * bx + by * by > ax * ax + ay * ay) {
+			ax = bx;
+			ay = by;
+		}
+		double len = hypot(ax, ay);
+		if (len > 0) {
+			if (ax < 0 || (ax == 0 && ay < 0))
+				len = -len;
+			u = POINT(ax / len, ay / len);
+		}
+	}
+
+	// Sort so the description doesn't depend on touch order
+	for (i = 0; i < n; i++) {
+		double dx = pts[i].x - c.x, dy = pts[i].y - c.y;
+		float pu = (dx * u.x + dy * u.y) / scale;
+		float pv = (u.x * dy - u.y * dx) / scale;
+		for (j = i; j > 0 && (d->v[2 * j - 2] > pu ||
+					(d->v[2 * j - 2] == pu &&
+					 d->v[2 * j - 1] > pv)); j--) {
+			d->v[2 * j] = d->v[2 * j - 2];
+			d->v[2 * j + 1] = d->v[2 * j - 1];
+		}
+		d->v[2 * j] = pu;
+		d->v[2 * j + 1] = pv;
+	}
+	d->n = n;
+}
+
+/*
+ * Describes the chord a template makes on the hand model
+ */
+void chord_template_describe(const struct chord_template *tmpl,
+		const struct point *anchors, double scale, struct chord_desc *d)
+{
+	struct point pts[CHORD_MAX_FINGERS];
+	int i, n = 0;
+
+	for (i = 0; i < CHORD_MAX_FINGERS; i++)
+		if (tmpl->fingers & (1u << i))
+			pts[n++] = anchors[i];
+	chord_describe(pts, n, scale, d);
+}
+
+/*
+ * Returns the hash key of a description, rounded to whole multiples of the
+ * scale, or 0 for a description of no chord
+ */
+uint64_t chord_key(const struct chord_desc *d)
+{
+	unsigned q[CHORD_MAX_FINGERS];
+	int i, j;
+
+	if (!d->n)
+		return 0;
+
+	// Rounding may reorder touches which were level along the box
+	for (i = 0; i < d->n; i++) {
+		unsigned v = quantise(d->v[2 * i]) << COORD_BITS |
+			quantise(d->v[2 * i + 1]);
+		for (j = i; j > 0 && q[j - 1] > v; j--)
+			q[j] = q[j - 1];
+		q[j] = v;
+	}
+
+	uint64_t key = d->n;
+	for (i = 0; i < d->n; i++)
+		key |= (uint64_t) q[i] << (3 + 2 * COORD_BITS * i);
+	return key;
+}
+
+/*
+ * Builds the nearest-neighbour index over a set of descriptions.  Matches are
+ * reported by position in descs.
+ */
+int chord_index_build(struct chord_index *ix, const struct chord_desc *descs,
+		int ndescs)
+{
+	int i, n, d;
+
+	memset(ix, 0, sizeof(*ix));
+	for (i = 0; i < ndescs; i++)
+		if (descs[i].n)
+			ix->groups[descs[i].n - 1].count++;
+
+	for (n = 1; n <= CHORD_MAX_FINGERS; n++) {
+		struct chord_group *g = &ix->groups[n - 1];
+		if (!g->count)
+			continue;
+		g->coords = malloc(2 * n * g->count * sizeof(g->coords[0]));
+		g->dist = malloc(g->count * sizeof(g->dist[0]));
+		g->ids = malloc(g->count * sizeof(g->ids[0]));
+		if (!g->coords || !g->dist || !g->ids) {
+			fprintf(stderr, "Failed to allocate chord index\n");
+			chord_index_free(ix);
+			return 1;
+		}
+
+		int j = 0;
+		for (i = 0; i < ndescs; i++) {
+			if (descs[i].n != n)
+				continue;
+			for (d = 0; d < 2 * n; d++)
+				g->coords[d * g->count + j] = descs[i].v[d];
+			g->ids[j++] = i;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Frees the nearest-neighbour index
+ */
+void chord_index_free(struct chord_index *ix)
+{
+	int n;
+
+	for (n = 0; n < CHORD_MAX_FINGERS; n++) {
+		free(ix->groups[n].ids);
+		free(ix->groups[n].dist);
+		free(ix->groups[n].coords);
+	}
+	memset(ix, 0, sizeof(*ix));
+}
+
+/*
+ * Finds the description in the index nearest to the given one with the same
+ * number of touches.  Returns its position, or -1 if there is none, and stores
+ * the distance to it and how much further the runner-up is (infinite if there
+ * is no runner-up), in multiples of the scale.
+ */
+int chord_match(struct chord_index *ix, const struct chord_desc *desc,
+		float *dist, float *margin)
+{
+	int j, d;
+
+	if (!desc->n)
+		return -1;
+	struct chord_group *g = &ix->groups[desc->n - 1];
+	if (!g->count)
+		return -1;
+
+	float *restrict acc = g->dist;
+	for (j = 0; j < g->count; j++)
+		acc[j] = 0;
+	for (d = 0; d < 2 * desc->n; d++) {
+		const float *restrict c = g->coords + d * g->count;
+		float q = desc->v[d];
+		for (j = 0; j < g->count; j++) {
+			float e = c[j] - q;
+			acc[j] += e * e;
+		}
+	}
+
+	int best = 0;
+	float d1 = INFINITY, d2 = INFINITY;
+	for (j = 0; j < g->count; j++) {
+		if (acc[j] < d1) {
+			d2 = d1;
+			d1 = acc[j];
+			best = j;
+		} else if (acc[j] < d2) {
+			d2 = acc[j];
+		}
+	}
+
+	*dist = sqrtf(d1);
+	*margin = sqrtf(d2) - *dist;
+	return g->ids[best];
+}
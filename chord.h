@@ -0,0 +1,58 @@
+#ifndef CHORD_H_
+#define CHORD_H_
+
+#include <stdint.h>
+
+#include "geometry.h"
+
+// Most fingers in a chord: one hand
+#define CHORD_MAX_FINGERS 5
+
+/*
+ * A chord of the layout: which fingers of the hand model make it (bit 0 for
+ * the thumb up to bit 4 for the little finger) and the keysym it types
+ */
+struct chord_template {
+	unsigned fingers;
+	const char *keysym;
+};
+
+/*
+ * Chord described by its touches in the frame of their oriented bounding box,
+ * as (u, v) pairs in multiples of the scale
+ */
+struct chord_desc {
+	int n;
+	float v[2 * CHORD_MAX_FINGERS];
+};
+
+/*
+ * Descriptions with one number of touches, stored coordinate by coordinate
+ */
+struct chord_group {
+	int count;
+	float *coords;
+	float *dist;
+	int *ids;
+};
+
+/*
+ * Nearest-neighbour index over descriptions, grouped by number of touches
+ */
+struct chord_index {
+	struct chord_group groups[CHORD_MAX_FINGERS];
+};
+
+void chord_describe(const struct point *pts, int n, double scale,
+		struct chord_desc *d);
+void chord_template_describe(const struct chord_template *tmpl,
+		const struct point *anchors, double scale, struct chord_desc *d);
+uint64_t chord_key(const struct chord_desc *d);
+
+int chord_index_build(struct chord_index *ix, const struct chord_desc *descs,
+		int ndescs);
+void chord_index_free(struct chord_index *ix);
+int chord_match(struct chord_index *ix, const struct chord_desc *desc,
+		float *dist, float *margin);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Benchmark for chord template matching
+ *
+ *
+ * Fills the nearest-neighbour index with random five-finger templates and
+ * times matching random chords against it, for a range of layout sizes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chord.h"
+#include "latency.h"
+
+#define MIN_TEMPLATES 16
+#define MAX_TEMPLATES 4096
+#define QUERIES 65536
+
+// Spread of the random coordinates, in chord scale steps
+#define SPREAD 8.0
+
+/*
+ * Fills a description of a five-finger chord with random coordinates
+ */
+static void random_desc(struct chord_desc *d)
+{
+	int i;
+
+	d->n = CHORD_MAX_FINGERS;
+	for (i = 0; i < 2 * CHORD_MAX_FINGERS; i++)
+		d->v[i] = SPREAD * (2.0 * rand() / RAND_MAX - 1);
+}
+
+int main(void)
+{
+	static struct chord_desc templates[MAX_TEMPLATES];
+	static struct chord_desc queries[QUERIES];
+	struct chord_index ix;
+	int i, n;
+
+	srand(1);
+	for (i = 0; i < MAX_TEMPLATES; i++)
+		random_desc(&templates[i]);
+	for (i = 0; i < QUERIES; i++)
+		random_desc(&queries[i]);
+
+	printf("%10s %12s\n", "templates", "ns/match");
+	for (n = MIN_TEMPLATES; n <= MAX_TEMPLATES; n *= 2) {
+		if (chord_index_build(&ix, templates, n))
+			return 1;
+
+		// Keep the results live so the loop isn't optimised out
+		long sum = 0;
+		uint64_t start = latency_now();
+		for (i = 0; i < QUERIES; i++) {
+			float dist, margin;
+			sum += chord_match(&ix, &queries[i], &dist, &margin);
+		}
+		uint64_t ns = latency_now() - start;
+
+		printf("%10d %12.1f\n", n, (double) ns / QUERIES);
+		if (sum < 0)
+			printf("no match\n");
+		chord_index_free(&ix);
+	}
+
+	return 0;
+}
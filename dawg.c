@@ -0,0 +1,276 @@
+/*
+ * Word completion from a directed acyclic word graph
+ *
+ *
+ * The graph is built offline by mkdawg and mapped as it is: a flat array of
+ * edges, with each node's edges next to each other.  Following a typed
+ * character is a scan of one node's edges, so the cursor keeps the edge taken
+ * for every character of the current word and each new character costs one
+ * step.  Completions are found best first: every edge records the highest
+ * score below it, so a search ordered by that bound reaches the k best words
+ * without looking at any path which can't beat them.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dawg.h"
+
+// Partial words the completion search can hold at once
+#define DAWG_SEARCH_MAX 1024
+
+/*
+ * Maps a word graph file.  Returns nonzero if it can't be read or isn't one.
+ */
+int dawg_open(struct dawg *d, const char *path)
+{
+	struct stat st;
+
+	memset(d, 0, sizeof(*d));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct dawg_header)) {
+		fprintf(stderr, "Can't read %s\n", path);
+		close(fd);
+		return 1;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Can't map %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	// Edges are checked as they are followed, so only the header has to
+	// be checked here
+	const struct dawg_header *h = map;
+	if (h->magic != DAWG_MAGIC || h->version != DAWG_VERSION ||
+			sizeof(*h) + (size_t) h->nedges *
+			sizeof(struct dawg_edge) != (size_t) st.st_size ||
+			h->root >= h->nedges) {
+		fprintf(stderr, "%s is not a word graph\n", path);
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	d->map = map;
+	d->size = st.st_size;
+	d->hdr = h;
+	d->edges = (const struct dawg_edge *) (h + 1);
+	return 0;
+}
+
+/*
+ * Unmaps a word graph
+ */
+void dawg_close(struct dawg *d)
+{
+	if (d->map)
+		munmap(d->map, d->size);
+	memset(d, 0, sizeof(*d));
+}
+
+/*
+ * Starts a new word
+ */
+void dawg_reset(struct dawg_cursor *c)
+{
+	c->depth = 0;
+	c->dead = 0;
+	c->word[0] = '\0';
+}
+
+/*
+ * Returns the first edge of the node the cursor is at, or 0 if it has none
+ */
+static uint32_t dawg_node(const struct dawg *d, const struct dawg_cursor *c)
+{
+	if (c->dead)
+		return 0;
+	if (!c->depth)
+		return d->hdr->root;
+	return d->edges[c->path[c->depth - 1]].child;
+}
+
+/*
+ * Follows a typed character
+ */
+void dawg_push(const struct dawg *d, struct dawg_cursor *c, char ch)
+{
+	uint32_t e = dawg_node(d, c);
+
+	// Letters past the longest word are counted like those past the end
+	// of the graph, so backspacing over them keeps in step
+	if (!e || c->depth == DAWG_MAX_WORD) {
+		c->dead++;
+		return;
+	}
+
+	for (; e < d->hdr->nedges; e++) {
+		if (d->edges[e].label == (uint8_t) ch)
+			break;
+		if (d->edges[e].flags & DAWG_LAST) {
+			e = d->hdr->nedges;
+			break;
+		}
+	}
+	if (e >= d->hdr->nedges || d->edges[e].child >= d->hdr->nedges) {
+		c->dead++;
+		return;
+	}
+
+	c->path[c->depth] = e;
+	c->word[c->depth++] = ch;
+	c->word[c->depth] = '\0';
+}
+
+/*
+ * Takes back the last character typed
+ */
+void dawg_pop(struct dawg_cursor *c)
+{
+	if (c->dead)
+		c->dead--;
+	else if (c->depth)
+		c->word[--c->depth] = '\0';
+}
+
+/*
+ * Partial word in the completion search: the edge it ends with, the entry for
+ * the partial word before it, and the best score it can lead to.  An entry
+ * can also stand for the finished word ending at its edge.
+ */
+struct dawg_entry {
+	uint32_t edge;
+	int parent;
+	uint8_t key;
+	uint8_t word;
+	uint8_t len;
+};
+
+/*
+ * Adds an entry to the search heap, ordered by key
+ */
+static void dawg_heap_push(const struct dawg_entry *pool, int *heap, int *n,
+		int entry)
+{
+	int i = (*n)++;
+
+	while (i) {
+		int up = (i - 1) / 2;
+		if (pool[heap[up]].key >= pool[entry].key)
+			break;
+		heap[i] = heap[up];
+		i = up;
+	}
+	heap[i] = entry;
+}
+
+/*
+ * Takes the entry with the highest key from the search heap
+ */
+static int dawg_heap_pop(const struct dawg_entry *pool, int *heap, int *n)
+{
+	int top = heap[0];
+	int last = heap[--(*n)];
+	int i = 0;
+
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= *n)
+			break;
+		if (child + 1 < *n && pool[heap[child + 1]].key >
+				pool[heap[child]].key)
+			child++;
+		if (pool[heap[child]].key <= pool[last].key)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+/*
+ * Finds up to k of the most common words starting with what has been typed,
+ * most common first, and stores them in words.  Returns how many there are.
+ */
+int dawg_complete(const struct dawg *d, const struct dawg_cursor *c,
+		char (*words)[DAWG_MAX_WORD + 1], int k)
+{
+	struct dawg_entry pool[DAWG_SEARCH_MAX];
+	int heap[DAWG_SEARCH_MAX];
+	int npool = 0, nheap = 0, found = 0;
+	uint32_t e;
+
+	if (!d->map || !c->depth || c->dead)
+		return 0;
+	if (k > DAWG_MAX_RESULTS)
+		k = DAWG_MAX_RESULTS;
+
+	// The prefix itself is a candidate, as are its continuations
+	const struct dawg_edge *pe = &d->edges[c->path[c->depth - 1]];
+	if (pe->flags & DAWG_FINAL) {
+		pool[npool] = (struct dawg_entry) {0, -1, pe->score, 1, 0};
+		dawg_heap_push(pool, heap, &nheap, npool++);
+	}
+	for (e = pe->child; e && e < d->hdr->nedges; e++) {
+		if (npool == DAWG_SEARCH_MAX)
+			break;
+		pool[npool] = (struct dawg_entry) {e, -1, d->edges[e].best, 0, 1};
+		dawg_heap_push(pool, heap, &nheap, npool++);
+		if (d->edges[e].flags & DAWG_LAST)
+			break;
+	}
+
+	while (nheap && found < k) {
+		int i = dawg_heap_pop(pool, heap, &nheap);
+		const struct dawg_entry *en = &pool[i];
+
+		// Nothing left in the heap can beat a finished word at the top
+		if (en->word) {
+			if (c->depth + en->len > DAWG_MAX_WORD)
+				continue;
+			char *w = words[found++];
+			memcpy(w, c->word, c->depth);
+			int j, at = c->depth + en->len;
+			w[at] = '\0';
+			for (j = en->len ? i : -1; j >= 0; j = pool[j].parent)
+				w[--at] = d->edges[pool[j].edge].label;
+			continue;
+		}
+
+		// A word entry points at the same edge as the partial word
+		const struct dawg_edge *ed = &d->edges[en->edge];
+		if ((ed->flags & DAWG_FINAL) && npool < DAWG_SEARCH_MAX) {
+			pool[npool] = *en;
+			pool[npool].key = ed->score;
+			pool[npool].word = 1;
+			dawg_heap_push(pool, heap, &nheap, npool++);
+		}
+		if (c->depth + en->len >= DAWG_MAX_WORD)
+			continue;
+		for (e = ed->child; e && e < d->hdr->nedges; e++) {
+			if (npool == DAWG_SEARCH_MAX)
+				break;
+			pool[npool] = (struct dawg_entry) {e, i, d->edges[e].best,
+				0, en->len + 1};
+			dawg_heap_push(pool, heap, &nheap, npool++);
+			if (d->edges[e].flags & DAWG_LAST)
+				break;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,72 @@
+#ifndef DAWG_H_
+#define DAWG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest word which can be completed, and most completions asked for at once
+#define DAWG_MAX_WORD 32
+#define DAWG_MAX_RESULTS 8
+
+#define DAWG_MAGIC 0x67776164
+#define DAWG_VERSION 1
+
+/*
+ * Header of a word graph file, followed by its edges
+ */
+struct dawg_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nedges;
+	uint32_t root;
+};
+
+// Edge flags: the edge ends a word, and is the last edge of its node
+#define DAWG_FINAL 1
+#define DAWG_LAST 2
+
+/*
+ * Edge of the word graph.  A node is a run of edges ending with one marked
+ * last, and is referred to by the index of its first edge; 0, which is never
+ * used, stands for a node without edges.  score is how common the word ending
+ * at the edge is, and best the highest score of any word through it.
+ */
+struct dawg_edge {
+	uint32_t child;
+	uint8_t label;
+	uint8_t flags;
+	uint8_t score;
+	uint8_t best;
+};
+
+/*
+ * Word graph mapped from its file
+ */
+struct dawg {
+	void *map;
+	size_t size;
+	const struct dawg_header *hdr;
+	const struct dawg_edge *edges;
+};
+
+/*
+ * Position in the graph of the word typed so far: the edge taken for each of
+ * its characters.  Characters typed after leaving the graph are only counted.
+ */
+struct dawg_cursor {
+	int depth;
+	int dead;
+	uint32_t path[DAWG_MAX_WORD];
+	char word[DAWG_MAX_WORD + 1];
+};
+
+int dawg_open(struct dawg *d, const char *path);
+void dawg_close(struct dawg *d);
+
+void dawg_reset(struct dawg_cursor *c);
+void dawg_push(const struct dawg *d, struct dawg_cursor *c, char ch);
+void dawg_pop(struct dawg_cursor *c);
+int dawg_complete(const struct dawg *d, const struct dawg_cursor *c,
+		char (*words)[DAWG_MAX_WORD + 1], int k);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Signal filtering for touch positions
+ *
+ *
+ * The One-Euro filter is described by Casiez, Roussel and Vogel in "1€
+ * Filter: A Simple Speed-based Low-pass Filter for Noisy Input in Interactive
+ * Systems" (CHI 2012).
+ *
+ * http://cristal.univ-lille.fr/~casiez/1euro/
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+
+#include "filter.h"
+
+// Smallest time step considered, in seconds, for events sharing a timestamp
+#define MIN_DT 0.001
+
+/*
+ * Returns the smoothing factor for an exponential low-pass filter with the
+ * given cutoff frequency and time step
+ */
+static double lowpass_alpha(double cutoff, double dt)
+{
+	double tau = 1.0 / (2 * M_PI * cutoff);
+	return 1.0 / (1.0 + tau / dt);
+}
+
+/*
+ * Starts the filter over at the given value and time
+ */
+void oneeuro_reset(struct oneeuro *f, double x, double t)
+{
+	f->x = x;
+	f->dx = 0;
+	f->t = t;
+	f->init = 1;
+}
+
+/*
+ * Feeds a new sample at time t (in seconds) through the filter and returns
+ * the filtered value.  The cutoff rises with speed, so slow movements are
+ * smoothed heavily and fast ones follow closely.
+ */
+double oneeuro_filter(struct oneeuro *f, const struct oneeuro_params *p,
+		double x, double t)
+{
+	if (!f->init) {
+		oneeuro_reset(f, x, t);
+		return x;
+	}
+
+	double dt = t - f->t;
+	if (dt < MIN_DT)
+		dt = MIN_DT;
+
+	// Filtered derivative first, which then sets the cutoff for the value
+	double a = lowpass_alpha(p->dcutoff, dt);
+	f->dx += a * ((x - f->x) / dt - f->dx);
+
+	double cutoff = p->mincutoff + p->beta * fabs(f->dx);
+	a = lowpass_alpha(cutoff, dt);
+	f->x += a * (x - f->x);
+	f->t = t;
+
+	return f->x;
+}
+
+/*
+ * Extrapolates the filtered value the given number of seconds past the last
+ * sample, assuming constant velocity
+ */
+double oneeuro_predict(const struct oneeuro *f, double horizon)
+{
+	return f->x + f->dx * horizon;
+}
@@ -0,0 +1,25 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+/*
+ * One-Euro filter state for a single axis
+ */
+struct oneeuro {
+	double x;
+	double dx;
+	double t;
+	int init;
+};
+
+struct oneeuro_params {
+	double mincutoff;
+	double beta;
+	double dcutoff;
+};
+
+void oneeuro_reset(struct oneeuro *f, double x, double t);
+double oneeuro_filter(struct oneeuro *f, const struct oneeuro_params *p,
+		double x, double t);
+double oneeuro_predict(const struct oneeuro *f, double horizon);
+
+#endif
@@ -342,8 +342,12 @@ static int left_turn(struct point p, struct point q, struct point r)
 /*
  * Calculates the convex hull of the given points, storing the points of the
  * hull in the hull array and returning the length of that array
+ *
+ * The work array must have room for 3 * n points; no memory is allocated, so
+ * this is safe to call from several threads on separate buffers.
  */
-int points_convex_hull(const struct point *pts, int n, struct point *hull)
+int points_convex_hull(const struct point *pts, int n, struct point *hull,
+		struct point *work)
 {
 	if (n < 0)
 		return -1;
@@ -354,13 +358,11 @@ int points_convex_hull(const struct point *pts, int n, struct point *hull)
 		return 1;
 	}
 
-	struct point *xsorted = malloc(n * sizeof(xsorted[0]));
-	assert(xsorted); //sloppy
+	struct point *xsorted = work;
 	memcpy(xsorted, pts, n * sizeof(xsorted[0]));
 	qsort(xsorted, n, sizeof(xsorted[0]), points_compare_x);
 
-	struct point *llower = malloc(n * sizeof(llower[0]));
-	assert(llower);
+	struct point *llower = work + n;
 	llower[0] = xsorted[0];
 	llower[1] = xsorted[1];
 
@@ -375,8 +377,7 @@ int points_convex_hull(const struct point *pts, int n, struct point *hull)
 		}
 	}
 
-	struct point *lupper = malloc(n * sizeof(lupper[0]));
-	assert(lupper);
+	struct point *lupper = work + 2 * n;
 	lupper[0] = xsorted[n - 1];
 	lupper[1] = xsorted[n - 2];
 
@@ -396,10 +397,6 @@ int points_convex_hull(const struct point *pts, int n, struct point *hull)
 	for (i = 0; i < li - 2; i++)
 		hull[ui + i] = lupper[i + 1];
 
-	free(lupper);
-	free(llower);
-	free(xsorted);
-
 	return ui + li - 2;
 }
 
@@ -503,3 +500,76 @@ double polygon_area(const struct point *poly, int n)
 		area += (poly[i].x + poly[last].x) * (poly[i].y - poly[last].y);
 	return area / 2;
 }
+
+/*
+ * Determines whether a point lies strictly inside a convex polygon, given in
+ * either order.  Points on an edge count as outside.
+ */
+int polygon_contains(const struct point *poly, int n, struct point p)
+{
+	int i, last, sign = 0;
+
+	if (n < 3)
+		return 0;
+	for (i = 0, last = n - 1; i < n; last = i++) {
+		double c = vector_cross(vector_sub(poly[i], poly[last]),
+				vector_sub(p, poly[last]));
+		if (c == 0 || (sign && (c > 0) != (sign > 0)))
+			return 0;
+		sign = c > 0 ? 1 : -1;
+	}
+	return 1;
+}
+
+/*
+ * Finds the root of a point's group, with every parent having a smaller index
+ * than its child
+ */
+static int cluster_find(int *parent, int i)
+{
+	while (parent[i] != i)
+		i = parent[i] = parent[parent[i]];
+	return i;
+}
+
+/*
+ * Splits points into groups by single-linkage clustering: two points share a
+ * group if a chain of points, each closer than dist to the next, joins them.
+ * Stores each point's group number in group and returns the number of groups.
+ * Groups are numbered in order of their first point.
+ */
+int points_cluster(const struct point *pts, int n, double dist, int *group)
+{
+	int i, j, k = 0;
+	double dist2 = dist * dist;
+
+	for (i = 0; i < n; i++)
+		group[i] = i;
+
+	// Union-find, always keeping the lower index as the root
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (point_distance2(pts[i], pts[j]) >= dist2)
+				continue;
+			int ri = cluster_find(group, i);
+			int rj = cluster_find(group, j);
+			if (ri < rj)
+				group[rj] = ri;
+			else if (rj < ri)
+				group[ri] = rj;
+		}
+	}
+
+	// Parents come before their children, so a single pass can number the
+	// roots and copy every other point's (negated) number from its parent
+	for (i = 0; i < n; i++) {
+		if (group[i] == i)
+			group[i] = -++k;
+		else
+			group[i] = group[group[i]];
+	}
+	for (i = 0; i < n; i++)
+		group[i] = -group[i] - 1;
+
+	return k;
+}
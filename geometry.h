@@ -16,9 +16,13 @@ struct point points_centroid(const struct point *pts, int n);
 struct point points_bbox_center(const struct point *pts, int n);
 struct point points_enclosing_center(const struct point *pts, int n);
 
-int points_convex_hull(const struct point *pts, int n, struct point *hull);
+int points_convex_hull(const struct point *pts, int n, struct point *hull,
+		struct point *work);
 void points_oriented_bbox(const struct point *hull, int n, struct point *rect);
 
 double polygon_area(const struct point *poly, int n);
+int polygon_contains(const struct point *poly, int n, struct point p);
+
+int points_cluster(const struct point *pts, int n, double dist, int *group);
 
 #endif
@@ -0,0 +1,110 @@
+/*
+ * Incremental estimation of pan/pinch/rotate gestures
+ *
+ *
+ * The transform is the 2-D least-squares similarity (orthogonal Procrustes
+ * with scaling) between the touch positions at the start of the gesture and
+ * their current positions.  With centred coordinates p' and q', the solution
+ * is
+ *
+ *   a = sum(p' . q'),  b = sum(p' x q'),
+ *   angle = atan2(b, a),  scale = hypot(a, b) / sum(|p'|^2),
+ *   t = mean(q) - scale * R(angle) * mean(p),
+ *
+ * and every one of those sums can be recovered from uncentred running sums,
+ * which change by a constant amount whenever one touch moves.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+
+#include "gesture.h"
+
+// Below this spread (in square pixels) the start points can't define a
+// rotation or scale
+#define MIN_SPREAD 1e-6
+
+void gesture_sums_reset(struct gesture_sums *g)
+{
+	g->n = 0;
+	g->sp = g->sq = POINT(0, 0);
+	g->spp = g->sdot = g->scross = 0;
+}
+
+void gesture_sums_add(struct gesture_sums *g, struct point p, struct point q)
+{
+	g->n++;
+	g->sp.x += p.x;
+	g->sp.y += p.y;
+	g->sq.x += q.x;
+	g->sq.y += q.y;
+	g->spp += p.x * p.x + p.y * p.y;
+	g->sdot += p.x * q.x + p.y * q.y;
+	g->scross += p.x * q.y - p.y * q.x;
+}
+
+/*
+ * Updates the sums for a touch which started at p and moved from oldq to newq
+ */
+void gesture_sums_move(struct gesture_sums *g, struct point p,
+		struct point oldq, struct point newq)
+{
+	double dx = newq.x - oldq.x;
+	double dy = newq.y - oldq.y;
+
+	g->sq.x += dx;
+	g->sq.y += dy;
+	g->sdot += p.x * dx + p.y * dy;
+	g->scross += p.x * dy - p.y * dx;
+}
+
+/*
+ * Finds the similarity which best maps the start points onto the current
+ * points.  With a single pair, or start points all in one place, only the
+ * translation is meaningful.  Returns 0 if there are no pairs.
+ */
+int gesture_solve(const struct gesture_sums *g, struct similarity *t)
+{
+	if (g->n < 1)
+		return 0;
+
+	struct point mp = POINT(g->sp.x / g->n, g->sp.y / g->n);
+	struct point mq = POINT(g->sq.x / g->n, g->sq.y / g->n);
+	double spread = g->spp - g->n * (mp.x * mp.x + mp.y * mp.y);
+
+	t->angle = 0;
+	t->scale = 1;
+	if (g->n > 1 && spread > MIN_SPREAD) {
+		double a = g->sdot - g->n * (mp.x * mq.x + mp.y * mq.y);
+		double b = g->scross - g->n * (mp.x * mq.y - mp.y * mq.x);
+		t->angle = atan2(b, a);
+		t->scale = hypot(a, b) / spread;
+	}
+
+	t->t = POINT(0, 0);
+	struct point rp = similarity_apply(t, mp);
+	t->t = POINT(mq.x - rp.x, mq.y - rp.y);
+	return 1;
+}
+
+/*
+ * Returns the similarity which applies b and then a
+ */
+struct similarity similarity_compose(const struct similarity *a,
+		const struct similarity *b)
+{
+	struct similarity c = {
+		.angle = a->angle + b->angle,
+		.scale = a->scale * b->scale,
+	};
+	c.t = similarity_apply(a, b->t);
+	return c;
+}
+
+struct point similarity_apply(const struct similarity *t, struct point p)
+{
+	double c = t->scale * cos(t->angle);
+	double s = t->scale * sin(t->angle);
+	return POINT(c * p.x - s * p.y + t->t.x, s * p.x + c * p.y + t->t.y);
+}
@@ -0,0 +1,41 @@
+#ifndef GESTURE_H_
+#define GESTURE_H_
+
+#include "geometry.h"
+
+/*
+ * Rotation by angle and uniform scaling about the origin, followed by a
+ * translation
+ */
+struct similarity {
+	struct point t;
+	double angle;
+	double scale;
+};
+
+#define SIMILARITY_IDENTITY ((struct similarity) {POINT(0, 0), 0, 1})
+
+/*
+ * Running sums over pairs of corresponding points (p at the start of the
+ * gesture, q now) from which the least-squares similarity taking each p to
+ * its q can be found in constant time
+ */
+struct gesture_sums {
+	int n;
+	struct point sp, sq;
+	double spp;
+	double sdot;
+	double scross;
+};
+
+void gesture_sums_reset(struct gesture_sums *g);
+void gesture_sums_add(struct gesture_sums *g, struct point p, struct point q);
+void gesture_sums_move(struct gesture_sums *g, struct point p,
+		struct point oldq, struct point newq);
+int gesture_solve(const struct gesture_sums *g, struct similarity *t);
+
+struct similarity similarity_compose(const struct similarity *a,
+		const struct similarity *b);
+struct point similarity_apply(const struct similarity *t, struct point p);
+
+#endif
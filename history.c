@@ -0,0 +1,150 @@
+/*
+ * Per-touch trajectory history
+ *
+ * Each ring is written only by the event thread.  The head counts every
+ * sample ever pushed and is published after the sample it covers, so a reader
+ * can copy samples without locking and then use the head again to throw away
+ * any that may have been overwritten while it was copying.  The start is
+ * where the head was when the current touch began, and only ever grows, so a
+ * reader which sees it unchanged after copying knows no other touch began in
+ * the ring meanwhile.
+ */
+
+#include <math.h>
+
+#include "history.h"
+
+#define HISTORY_MASK (HISTORY_LEN - 1)
+
+// Times a snapshot is retried when a new touch begins while it is copying
+#define SNAPSHOT_TRIES 4
+
+#if HISTORY_LEN & HISTORY_MASK
+#error "HISTORY_LEN must be a power of two"
+#endif
+
+/*
+ * Stores a sample at the head and publishes it
+ */
+static void history_store(struct touch_history *h, uint32_t time, double x,
+		double y)
+{
+	unsigned long head = h->head;
+	h->s[head & HISTORY_MASK] = (struct touch_sample) {time, x, y};
+	__atomic_store_n(&h->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts the history of a new touch in this ring
+ */
+void history_begin(struct touch_history *h, uint32_t time, double x, double y)
+{
+	__atomic_store_n(&h->start, h->head, __ATOMIC_RELEASE);
+	history_store(h, time, x, y);
+}
+
+/*
+ * Appends a sample to the history of the current touch
+ */
+void history_push(struct touch_history *h, uint32_t time, double x, double y)
+{
+	history_store(h, time, x, y);
+}
+
+/*
+ * Copies up to max of the most recent samples of the current touch into out,
+ * oldest first, and returns how many were copied.  Safe to call from any
+ * thread while the ring is being written.
+ */
+int history_snapshot(const struct touch_history *h, struct touch_sample *out,
+		int max)
+{
+	unsigned long head, start, first, last, i;
+	int tries;
+
+	if (max > HISTORY_LEN)
+		max = HISTORY_LEN;
+
+	for (tries = 0; tries < SNAPSHOT_TRIES; tries++) {
+		// The start is read first: it is published before the head
+		// moves on from it, so the head read after can't be behind
+		start = __atomic_load_n(&h->start, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		first = head - start > (unsigned long) max ? head - max : start;
+		for (i = first; i < head; i++)
+			out[i - first] = h->s[i & HISTORY_MASK];
+
+		// Another touch may have begun while copying, in which case
+		// what was copied can belong to either
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		last = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&h->start, __ATOMIC_RELAXED) != start)
+			continue;
+
+		// Slots from the current head back a full ring may have been
+		// rewritten by the time we read them
+		if (last - first >= HISTORY_LEN) {
+			unsigned long lost = last - first - HISTORY_LEN + 1;
+			if (lost >= head - first)
+				return 0;
+			for (i = 0; i < head - first - lost; i++)
+				out[i] = out[i + lost];
+			first += lost;
+		}
+		return head - first;
+	}
+
+	return 0;
+}
+
+/*
+ * Computes the mean velocity, in pixels per second, over a snapshot.  Returns
+ * 0 if it spans no time.
+ */
+int history_velocity(const struct touch_sample *s, int n, double *vx,
+		double *vy)
+{
+	if (n < 2 || s[n - 1].time == s[0].time)
+		return 0;
+
+	double dt = (s[n - 1].time - s[0].time) / 1000.0;
+	*vx = (s[n - 1].x - s[0].x) / dt;
+	*vy = (s[n - 1].y - s[0].y) / dt;
+	return 1;
+}
+
+/*
+ * Computes the mean acceleration, in pixels per second squared, over a
+ * snapshot from the velocities of its two halves.  Returns 0 if either half
+ * spans no time.
+ */
+int history_acceleration(const struct touch_sample *s, int n, double *ax,
+		double *ay)
+{
+	double v1x, v1y, v2x, v2y;
+	int mid = n / 2;
+
+	if (n < 4 || !history_velocity(s, mid + 1, &v1x, &v1y) ||
+			!history_velocity(s + mid, n - mid, &v2x, &v2y))
+		return 0;
+
+	double dt = ((s[n - 1].time + s[mid].time) -
+			(s[mid].time + s[0].time)) / 2000.0;
+	*ax = (v2x - v1x) / dt;
+	*ay = (v2y - v1y) / dt;
+	return 1;
+}
+
+/*
+ * Returns the length, in pixels, of the path traced over a snapshot.  Summing
+ * it here rather than as samples are pushed keeps the writer's work constant.
+ */
+double history_path(const struct touch_sample *s, int n)
+{
+	double len = 0;
+	int i;
+
+	for (i = 1; i < n; i++)
+		len += hypot(s[i].x - s[i - 1].x, s[i].y - s[i - 1].y);
+	return len;
+}
@@ -0,0 +1,35 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdint.h>
+
+// Samples kept per touch; must be a power of two
+#define HISTORY_LEN 64
+
+struct touch_sample {
+	uint32_t time;
+	double x, y;
+};
+
+/*
+ * Ring of the most recent samples of a touch.  There is a single writer, but
+ * snapshots may be taken from other threads at any time.
+ */
+struct touch_history {
+	unsigned long head;
+	unsigned long start;
+	struct touch_sample s[HISTORY_LEN];
+};
+
+void history_begin(struct touch_history *h, uint32_t time, double x, double y);
+void history_push(struct touch_history *h, uint32_t time, double x, double y);
+int history_snapshot(const struct touch_history *h, struct touch_sample *out,
+		int max);
+
+int history_velocity(const struct touch_sample *s, int n, double *vx,
+		double *vy);
+int history_acceleration(const struct touch_sample *s, int n, double *ax,
+		double *ay);
+double history_path(const struct touch_sample *s, int n);
+
+#endif
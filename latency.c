@@ -0,0 +1,110 @@
+/*
+ * Latency measurement
+ *
+ * Latencies are binned by microsecond into a histogram with a fixed number of
+ * buckets per power of two, which keeps recording constant-time and the
+ * relative error of any percentile under 1 / LATENCY_SUBBUCKETS.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <time.h>
+
+#include "latency.h"
+
+/*
+ * Returns the current monotonic time in nanoseconds
+ */
+uint64_t latency_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns the histogram bucket for a latency in microseconds
+ */
+static int latency_bucket(uint64_t us)
+{
+	if (us < LATENCY_SUBBUCKETS)
+		return us;
+
+	int exp = 63 - __builtin_clzll(us);
+	int sub = (us >> (exp - LATENCY_SUBBUCKET_BITS)) &
+		(LATENCY_SUBBUCKETS - 1);
+	int bucket = (exp - LATENCY_SUBBUCKET_BITS + 1) * LATENCY_SUBBUCKETS +
+		sub;
+	return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Returns the smallest latency in microseconds which falls in a bucket
+ */
+static uint64_t latency_bucket_min(int bucket)
+{
+	if (bucket < LATENCY_SUBBUCKETS)
+		return bucket;
+
+	int exp = bucket / LATENCY_SUBBUCKETS + LATENCY_SUBBUCKET_BITS - 1;
+	int sub = bucket % LATENCY_SUBBUCKETS;
+	return (uint64_t) (LATENCY_SUBBUCKETS + sub) <<
+		(exp - LATENCY_SUBBUCKET_BITS);
+}
+
+/*
+ * Adds a latency, given in nanoseconds, to the histogram
+ */
+void latency_record(struct latency_hist *h, uint64_t ns)
+{
+	h->counts[latency_bucket(ns / 1000)]++;
+	h->total++;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/*
+ * Returns an estimate, in nanoseconds, of the given percentile (0-100) of the
+ * recorded latencies, or 0 if nothing has been recorded
+ */
+uint64_t latency_percentile(const struct latency_hist *h, double p)
+{
+	uint64_t rank = h->total * p / 100;
+	uint64_t seen = 0;
+	int i;
+
+	if (!h->total)
+		return 0;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += h->counts[i];
+		if (seen > rank)
+			break;
+	}
+
+	// Middle of the bucket
+	uint64_t lo = latency_bucket_min(i);
+	uint64_t hi = latency_bucket_min(i + 1);
+	return (lo + hi) * 1000 / 2;
+}
+
+/*
+ * Prints a one-line summary of a histogram
+ */
+void latency_report(const struct latency_hist *h, const char *name, FILE *f)
+{
+	if (!h->total) {
+		fprintf(f, "%s: no samples\n", name);
+		return;
+	}
+
+	fprintf(f, "%s: n=%llu mean=%.1fus p50=%.1fus p90=%.1fus "
+			"p99=%.1fus max=%.1fus\n", name,
+			(unsigned long long) h->total,
+			h->sum / 1000.0 / h->total,
+			latency_percentile(h, 50) / 1000.0,
+			latency_percentile(h, 90) / 1000.0,
+			latency_percentile(h, 99) / 1000.0,
+			h->max / 1000.0);
+}
@@ -0,0 +1,28 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Four buckets per power of two, covering 1us up to about 65ms
+#define LATENCY_SUBBUCKET_BITS 2
+#define LATENCY_SUBBUCKETS (1 << LATENCY_SUBBUCKET_BITS)
+#define LATENCY_BUCKETS (16 * LATENCY_SUBBUCKETS)
+
+/*
+ * Log-linear histogram of latencies
+ */
+struct latency_hist {
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t max;
+};
+
+uint64_t latency_now(void);
+
+void latency_record(struct latency_hist *h, uint64_t ns);
+uint64_t latency_percentile(const struct latency_hist *h, double p);
+void latency_report(const struct latency_hist *h, const char *name, FILE *f);
+
+#endif
@@ -0,0 +1,632 @@
+/*
+ * Chord layouts
+ *
+ *
+ * A layout file lists one chord per line: the fingers of the hand model which
+ * make it, as five characters (T, I, M, R and L for the thumb to the little
+ * finger, '.' for a finger left up), and the keysym it types.  An optional
+ * "anchors" line replaces the hand model with five x y pairs.
+ *
+ *   # Right hand, fingers pointing up
+ *   anchors 0 0  90 130  170 160  250 140  320 90
+ *   TI... e
+ *   .IMRL Return
+ *
+ * Layouts are compiled into one flat blob holding a minimal perfect hash from
+ * descriptor key to chord, built by hash-and-displace: the keys are split into
+ * buckets by one hash, and each bucket, largest first, gets the smallest
+ * displacement which sends all its keys to free slots under a second hash.  A
+ * lookup is then two hashes, two loads and a comparison against the stored
+ * key.  The blob is cached next to the layout file, so later runs only have to
+ * map it.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "layout.h"
+
+#define LAYOUT_MAGIC 0x6c647263
+#define LAYOUT_VERSION 3
+
+// Compiled layouts are cached in a file of the same name plus this suffix
+#define CACHE_SUFFIX ".cache"
+
+// Average keys per bucket of the perfect hash, and how many displacements to
+// try for one bucket before starting over with more buckets
+#define KEYS_PER_BUCKET 2
+#define MAX_DISPLACEMENT (1u << 20)
+
+static const char *const finger_names = "TIMRL";
+
+/*
+ * Scrambles the bits of a 64-bit value (the SplitMix64 finaliser)
+ */
+static uint64_t layout_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+/*
+ * Returns the bucket of a key
+ */
+static uint32_t layout_bucket(uint64_t key, uint32_t nbuckets)
+{
+	return layout_mix(key) % nbuckets;
+}
+
+/*
+ * Returns the slot of a key under its bucket's displacement
+ */
+static uint32_t layout_slot(uint64_t key, uint32_t d, uint32_t nkeys)
+{
+	return layout_mix(key ^ (d + 1) * 0x9e3779b97f4a7c15ull) % nkeys;
+}
+
+/*
+ * Returns the modification time of a file in nanoseconds, since edits made
+ * within a second of writing the cache must still be noticed
+ */
+static int64_t layout_mtime(const struct stat *st)
+{
+	return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Identifies how chords are keyed, by FNV-1a over the default anchors and the
+ * key of every combination of fingers on them.  Keys baked into a cache only
+ * hold for the built-in hand model and the description and rounding of the
+ * binary which made them.
+ */
+static uint64_t layout_keying(const struct point *anchors, double scale)
+{
+	const unsigned char *p = (const unsigned char *) anchors;
+	uint64_t h = 0xcbf29ce484222325ull;
+	unsigned fingers;
+	size_t i;
+
+	for (i = 0; i < CHORD_MAX_FINGERS * sizeof(anchors[0]); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	for (fingers = 1; fingers < 1u << CHORD_MAX_FINGERS; fingers++) {
+		struct chord_template t = {fingers, NULL};
+		struct chord_desc d;
+		chord_template_describe(&t, anchors, scale, &d);
+		uint64_t key = chord_key(&d);
+		for (i = 0; i < sizeof(key); i++) {
+			h ^= (key >> (8 * i)) & 0xff;
+			h *= 0x100000001b3ull;
+		}
+	}
+	return h;
+}
+
+/*
+ * Returns the size of a compiled layout with the given header
+ */
+static size_t layout_size(const struct layout_header *h)
+{
+	return sizeof(*h) + h->nkeys * sizeof(uint64_t) +
+		CHORD_MAX_FINGERS * sizeof(struct point) +
+		((size_t) h->nbuckets + h->nkeys + 2 * h->nchords) *
+		sizeof(uint32_t) + h->names_len;
+}
+
+/*
+ * Points the section pointers of a layout into a compiled blob
+ */
+static void layout_attach(struct layout *l, void *blob, size_t size,
+		int mapped)
+{
+	const char *p = blob;
+
+	l->blob = blob;
+	l->size = size;
+	l->mapped = mapped;
+	l->hdr = blob;
+	p += sizeof(*l->hdr);
+	l->keys = (const uint64_t *) p;
+	p += l->hdr->nkeys * sizeof(l->keys[0]);
+	l->anchors = (const struct point *) p;
+	p += CHORD_MAX_FINGERS * sizeof(l->anchors[0]);
+	l->disp = (const uint32_t *) p;
+	p += l->hdr->nbuckets * sizeof(l->disp[0]);
+	l->chords = (const uint32_t *) p;
+	p += l->hdr->nkeys * sizeof(l->chords[0]);
+	l->fingers = (const uint32_t *) p;
+	p += l->hdr->nchords * sizeof(l->fingers[0]);
+	l->names = (const uint32_t *) p;
+	p += l->hdr->nchords * sizeof(l->names[0]);
+	l->text = p;
+}
+
+/*
+ * Finds a displacement for every bucket so that the keys fill the slots
+ * exactly once.  Returns 1 if some bucket has none within the limit, or -1 if
+ * out of memory.
+ */
+static int layout_displace(const uint64_t *keys, int nkeys, uint32_t nbuckets,
+		uint32_t *disp, int *slotkey)
+{
+	int *count = calloc(nbuckets + 1, sizeof(count[0]));
+	int *members = malloc(nkeys * sizeof(members[0]));
+	uint32_t *order = malloc(nbuckets * sizeof(order[0]));
+	uint32_t *slots = malloc(nkeys * sizeof(slots[0]));
+	int ret = 1;
+	int i, j, k;
+
+	if (!count || !members || !order || !slots) {
+		fprintf(stderr, "Failed to allocate perfect hash\n");
+		ret = -1;
+		goto out;
+	}
+
+	// Group the keys by bucket, with count[b] the start of bucket b
+	for (i = 0; i < nkeys; i++)
+		count[layout_bucket(keys[i], nbuckets) + 1]++;
+	for (i = 0; i < (int) nbuckets; i++)
+		count[i + 1] += count[i];
+	for (i = 0; i < (int) nbuckets; i++)
+		order[i] = count[i];
+	for (i = 0; i < nkeys; i++)
+		members[order[layout_bucket(keys[i], nbuckets)]++] = i;
+
+	// Largest buckets first, while there is most room
+	for (i = 0; i < (int) nbuckets; i++) {
+		int size = count[i + 1] - count[i];
+		for (j = i; j > 0 && count[order[j - 1] + 1] -
+				count[order[j - 1]] < size; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (i = 0; i < nkeys; i++)
+		slotkey[i] = -1;
+	for (i = 0; i < (int) nbuckets; i++) {
+		uint32_t b = order[i];
+		int n = count[b + 1] - count[b];
+		uint32_t d;
+
+		disp[b] = 0;
+		if (!n)
+			continue;
+		for (d = 0; d < MAX_DISPLACEMENT; d++) {
+			for (j = 0; j < n; j++) {
+				slots[j] = layout_slot(keys[members[count[b] + j]],
+						d, nkeys);
+				if (slotkey[slots[j]] >= 0)
+					break;
+				for (k = 0; k < j && slots[k] != slots[j]; k++)
+					;
+				if (k < j)
+					break;
+			}
+			if (j == n)
+				break;
+		}
+		if (d == MAX_DISPLACEMENT)
+			goto out;
+
+		disp[b] = d;
+		for (j = 0; j < n; j++)
+			slotkey[slots[j]] = members[count[b] + j];
+	}
+	ret = 0;
+
+out:
+	free(slots);
+	free(order);
+	free(members);
+	free(count);
+	return ret;
+}
+
+/*
+ * Compiles chord templates into a layout blob.  Templates which can't be told
+ * apart from an earlier one are reported and left out.
+ */
+static void *layout_compile(const struct chord_template *tmpl, int n,
+		const struct point *anchors, double scale, uint64_t keying,
+		const struct stat *src, size_t *size)
+{
+	uint64_t *keys = malloc(n * sizeof(keys[0]));
+	int *keychord = malloc(n * sizeof(keychord[0]));
+	int *slotkey = malloc(n * sizeof(slotkey[0]));
+	uint32_t *disp = NULL;
+	char *blob = NULL;
+	struct layout_header h = {
+		.magic = LAYOUT_MAGIC,
+		.version = LAYOUT_VERSION,
+		.source_mtime = src ? layout_mtime(src) : 0,
+		.source_size = src ? src->st_size : 0,
+		.scale = scale,
+		.keying = keying,
+		.nchords = n,
+	};
+	int i, j;
+
+	if (!keys || !keychord || !slotkey) {
+		fprintf(stderr, "Failed to allocate layout\n");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct chord_desc d;
+		chord_template_describe(&tmpl[i], anchors, scale, &d);
+		uint64_t key = chord_key(&d);
+		if (!key) {
+			fprintf(stderr, "Chord for %s has no fingers\n",
+					tmpl[i].keysym);
+			continue;
+		}
+		for (j = 0; j < (int) h.nkeys && keys[j] != key; j++)
+			;
+		if (j < (int) h.nkeys) {
+			fprintf(stderr, "Chord for %s is indistinguishable "
+					"from %s\n", tmpl[i].keysym,
+					tmpl[keychord[j]].keysym);
+			continue;
+		}
+		keys[h.nkeys] = key;
+		keychord[h.nkeys++] = i;
+	}
+	for (i = 0; i < n; i++)
+		h.names_len += strlen(tmpl[i].keysym) + 1;
+	if (!h.nkeys) {
+		fprintf(stderr, "Layout has no usable chords\n");
+		goto out;
+	}
+
+	// More buckets make displacements easier to find
+	for (h.nbuckets = h.nkeys / KEYS_PER_BUCKET + 1; ;
+			h.nbuckets *= 2) {
+		free(disp);
+		disp = malloc(h.nbuckets * sizeof(disp[0]));
+		if (!disp) {
+			fprintf(stderr, "Failed to allocate layout\n");
+			goto out;
+		}
+		int r = layout_displace(keys, h.nkeys, h.nbuckets, disp,
+				slotkey);
+		if (r < 0)
+			goto out;
+		if (!r)
+			break;
+	}
+
+	*size = layout_size(&h);
+	blob = malloc(*size);
+	if (!blob) {
+		fprintf(stderr, "Failed to allocate layout\n");
+		goto out;
+	}
+
+	struct layout l;
+	memcpy(blob, &h, sizeof(h));
+	layout_attach(&l, blob, *size, 0);
+	for (i = 0; i < (int) h.nkeys; i++) {
+		((uint64_t *) l.keys)[i] = keys[slotkey[i]];
+		((uint32_t *) l.chords)[i] = keychord[slotkey[i]];
+	}
+	memcpy((struct point *) l.anchors, anchors,
+			CHORD_MAX_FINGERS * sizeof(l.anchors[0]));
+	memcpy((uint32_t *) l.disp, disp, h.nbuckets * sizeof(disp[0]));
+
+	char *text = (char *) l.text;
+	uint32_t off = 0;
+	for (i = 0; i < n; i++) {
+		// Chords left out of the hash are kept with no fingers, so
+		// nothing can match them
+		for (j = 0; j < (int) h.nkeys && keychord[j] != i; j++)
+			;
+		((uint32_t *) l.fingers)[i] = j < (int) h.nkeys ?
+			tmpl[i].fingers : 0;
+		((uint32_t *) l.names)[i] = off;
+		size_t len = strlen(tmpl[i].keysym) + 1;
+		memcpy(text + off, tmpl[i].keysym, len);
+		off += len;
+	}
+
+out:
+	free(disp);
+	free(slotkey);
+	free(keychord);
+	free(keys);
+	return blob;
+}
+
+/*
+ * Parses a layout file and compiles it.  The hand model starts out as the
+ * given anchors.
+ */
+static void *layout_parse(const char *path, const struct stat *st,
+		const struct point *defanchors, double scale, uint64_t keying,
+		size_t *size)
+{
+	struct point anchors[CHORD_MAX_FINGERS];
+	struct chord_template *tmpl = NULL;
+	int ntmpl = 0;
+	char *buf = NULL;
+	void *blob = NULL;
+	int lineno = 0;
+	int i;
+
+	memcpy(anchors, defanchors, sizeof(anchors));
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Can't open layout %s: %s\n", path,
+				strerror(errno));
+		return NULL;
+	}
+	buf = malloc(st->st_size + 1);
+	// Every chord needs at least a finger mask, a keysym and a newline
+	tmpl = malloc((st->st_size / 8 + 1) * sizeof(tmpl[0]));
+	if (!buf || !tmpl) {
+		fprintf(stderr, "Failed to allocate layout\n");
+		goto out;
+	}
+	size_t len = fread(buf, 1, st->st_size, f);
+	buf[len] = '\0';
+
+	char *line, *next;
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		lineno++;
+
+		char *hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+		char *word = strtok(line, " \t\r");
+		if (!word)
+			continue;
+
+		if (!strcmp(word, "anchors")) {
+			for (i = 0; i < 2 * CHORD_MAX_FINGERS; i++) {
+				char *num = strtok(NULL, " \t\r");
+				char *end;
+				double v = num ? strtod(num, &end) : 0;
+				if (!num || *end)
+					break;
+				if (i % 2)
+					anchors[i / 2].y = v;
+				else
+					anchors[i / 2].x = v;
+			}
+			if (i < 2 * CHORD_MAX_FINGERS || strtok(NULL, " \t\r")) {
+				fprintf(stderr, "%s:%d: anchors needs %d x y "
+						"pairs\n", path, lineno,
+						CHORD_MAX_FINGERS);
+				goto out;
+			}
+			continue;
+		}
+
+		unsigned fingers = 0;
+		for (i = 0; i < CHORD_MAX_FINGERS && word[i]; i++) {
+			if (word[i] == finger_names[i])
+				fingers |= 1u << i;
+			else if (word[i] != '.')
+				break;
+		}
+		char *keysym = strtok(NULL, " \t\r");
+		if (i < CHORD_MAX_FINGERS || word[i] || !keysym ||
+				strtok(NULL, " \t\r")) {
+			fprintf(stderr, "%s:%d: expected fingers (like TI...) "
+					"and a keysym\n", path, lineno);
+			goto out;
+		}
+		tmpl[ntmpl++] = (struct chord_template) {fingers, keysym};
+	}
+
+	blob = layout_compile(tmpl, ntmpl, anchors, scale, keying, st, size);
+
+out:
+	free(tmpl);
+	free(buf);
+	fclose(f);
+	return blob;
+}
+
+/*
+ * Maps a cached layout, provided it was compiled from the current version of
+ * the source with the same scale and keying
+ */
+static int layout_map(struct layout *l, const char *cache,
+		const struct stat *src, double scale, uint64_t keying)
+{
+	struct stat st;
+	int fd = open(cache, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct layout_header)) {
+		close(fd);
+		return 1;
+	}
+
+	void *blob = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (blob == MAP_FAILED)
+		return 1;
+
+	const struct layout_header *h = blob;
+	if (h->magic != LAYOUT_MAGIC || h->version != LAYOUT_VERSION ||
+			h->source_mtime != layout_mtime(src) ||
+			h->source_size != (uint64_t) src->st_size ||
+			h->scale != scale || h->keying != keying ||
+			!h->nkeys || !h->nbuckets ||
+			layout_size(h) != (size_t) st.st_size) {
+		munmap(blob, st.st_size);
+		return 1;
+	}
+
+	// Everything the lookups index must stay inside the blob
+	struct layout m;
+	uint32_t i;
+	layout_attach(&m, blob, st.st_size, 1);
+	for (i = 0; i < h->nkeys && m.chords[i] < h->nchords; i++)
+		;
+	int bad = i < h->nkeys || !h->names_len || m.text[h->names_len - 1];
+	for (i = 0; !bad && i < h->nchords; i++)
+		bad = m.names[i] >= h->names_len;
+	if (bad) {
+		munmap(blob, st.st_size);
+		return 1;
+	}
+
+	*l = m;
+	return 0;
+}
+
+/*
+ * Writes a compiled layout to its cache file, replacing any old one in a
+ * single step
+ */
+static int layout_write(const char *cache, const void *blob, size_t size)
+{
+	char *tmp = malloc(strlen(cache) + sizeof(".tmp"));
+	if (!tmp)
+		return 1;
+	sprintf(tmp, "%s.tmp", cache);
+
+	FILE *f = fopen(tmp, "wb");
+	int ret = !f || fwrite(blob, 1, size, f) != size;
+	if (f && fclose(f))
+		ret = 1;
+	if (!ret && rename(tmp, cache))
+		ret = 1;
+	if (ret) {
+		fprintf(stderr, "Can't cache layout in %s: %s\n", cache,
+				strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Compiles a layout from templates held in memory
+ */
+int layout_build(struct layout *l, const struct chord_template *tmpl, int n,
+		const struct point *anchors, double scale)
+{
+	size_t size;
+	void *blob = layout_compile(tmpl, n, anchors, scale,
+			layout_keying(anchors, scale), NULL, &size);
+	if (!blob)
+		return 1;
+	layout_attach(l, blob, size, 0);
+	return 0;
+}
+
+/*
+ * Loads a layout file, from its compiled cache if that is up to date, or else
+ * by compiling it and refreshing the cache
+ */
+int layout_load(struct layout *l, const char *path,
+		const struct point *anchors, double scale)
+{
+	uint64_t keying = layout_keying(anchors, scale);
+	struct stat st;
+	size_t size;
+	int ret = 1;
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "Can't open layout %s: %s\n", path,
+				strerror(errno));
+		return 1;
+	}
+
+	char *cache = malloc(strlen(path) + sizeof(CACHE_SUFFIX));
+	if (!cache) {
+		fprintf(stderr, "Failed to allocate layout\n");
+		return 1;
+	}
+	sprintf(cache, "%s" CACHE_SUFFIX, path);
+
+	if (!layout_map(l, cache, &st, scale, keying)) {
+		ret = 0;
+		goto out;
+	}
+
+	void *blob = layout_parse(path, &st, anchors, scale, keying, &size);
+	if (!blob)
+		goto out;
+
+	// Use the cache just written, so this run behaves like later ones,
+	// but carry on from memory if it couldn't be
+	if (!layout_write(cache, blob, size) &&
+			!layout_map(l, cache, &st, scale, keying))
+		free(blob);
+	else
+		layout_attach(l, blob, size, 0);
+	ret = 0;
+
+out:
+	free(cache);
+	return ret;
+}
+
+/*
+ * Frees or unmaps a layout
+ */
+void layout_free(struct layout *l)
+{
+	if (l->mapped)
+		munmap(l->blob, l->size);
+	else
+		free(l->blob);
+	l->blob = NULL;
+}
+
+/*
+ * Returns the chord whose descriptor has the given key, or -1 if none does
+ */
+int layout_lookup(const struct layout *l, uint64_t key)
+{
+	uint32_t d = l->disp[layout_bucket(key, l->hdr->nbuckets)];
+	uint32_t slot = layout_slot(key, d, l->hdr->nkeys);
+	return l->keys[slot] == key ? (int) l->chords[slot] : -1;
+}
+
+/*
+ * Returns the number of chords in a layout
+ */
+int layout_count(const struct layout *l)
+{
+	return l->hdr->nchords;
+}
+
+/*
+ * Returns the name of the keysym a chord types
+ */
+const char *layout_keysym(const struct layout *l, int i)
+{
+	return l->text + l->names[i];
+}
+
+/*
+ * Returns the template of a chord
+ */
+void layout_template(const struct layout *l, int i, struct chord_template *t)
+{
+	t->fingers = l->fingers[i];
+	t->keysym = layout_keysym(l, i);
+}
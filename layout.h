@@ -0,0 +1,59 @@
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "geometry.h"
+#include "chord.h"
+
+/*
+ * Header of a compiled layout.  The sections follow it in this order: hash
+ * keys, hand model anchors, hash displacements, the chord each key maps to,
+ * the finger mask and keysym name offset of each chord, and the names.
+ */
+struct layout_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t source_mtime;
+	uint64_t source_size;
+	double scale;
+	uint64_t keying;
+	uint32_t nchords;
+	uint32_t nkeys;
+	uint32_t nbuckets;
+	uint32_t names_len;
+};
+
+/*
+ * Chord layout compiled into a minimal perfect hash from descriptor key to
+ * chord, either mapped from its cache file or held in memory
+ */
+struct layout {
+	void *blob;
+	size_t size;
+	int mapped;
+
+	const struct layout_header *hdr;
+	const uint64_t *keys;
+	const struct point *anchors;
+	const uint32_t *disp;
+	const uint32_t *chords;
+	const uint32_t *fingers;
+	const uint32_t *names;
+	const char *text;
+};
+
+int layout_build(struct layout *l, const struct chord_template *tmpl, int n,
+		const struct point *anchors, double scale);
+int layout_load(struct layout *l, const char *path,
+		const struct point *anchors, double scale);
+void layout_free(struct layout *l);
+
+int layout_lookup(const struct layout *l, uint64_t key);
+int layout_count(const struct layout *l);
+const char *layout_keysym(const struct layout *l, int i);
+void layout_template(const struct layout *l, int i, struct chord_template *t);
+
+#endif
@@ -0,0 +1,388 @@
+/*
+ * Word graph builder
+ *
+ *
+ * Reads a word list, one word per line with an optional count of how common
+ * it is, and writes the directed acyclic word graph charade completes words
+ * from.  The words are put in a trie, whose nodes are then merged bottom-up
+ * wherever two of them would lead to the same words with the same scores;
+ * scores are the logarithm of the count, scaled to a byte, which keeps many
+ * common suffixes shareable.  Each distinct node is written out as a run of
+ * edges, parents before children.
+ *
+ *   usage: mkdawg words.txt words.dawg
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "dawg.h"
+
+/*
+ * Word read from the list
+ */
+struct word {
+	char *text;
+	double count;
+};
+
+/*
+ * Trie node.  Children are kept in order of label, as a list through next.
+ */
+struct tnode {
+	int child;
+	int next;
+	int canon;
+	uint32_t pos;
+	uint8_t label;
+	uint8_t final;
+	uint8_t score;
+	uint8_t best;
+};
+
+struct trie {
+	struct tnode *nodes;
+	int n, cap;
+	int *table;
+	int tsize;
+};
+
+static int compare_words(const void *a, const void *b)
+{
+	return strcmp(((const struct word *) a)->text,
+			((const struct word *) b)->text);
+}
+
+/*
+ * Adds a node to the trie, returning its index or -1
+ */
+static int trie_node(struct trie *t, uint8_t label)
+{
+	if (t->n == t->cap) {
+		int cap = t->cap ? 2 * t->cap : 1024;
+		struct tnode *nodes = realloc(t->nodes, cap * sizeof(nodes[0]));
+		if (!nodes)
+			return -1;
+		t->nodes = nodes;
+		t->cap = cap;
+	}
+	t->nodes[t->n] = (struct tnode) {
+		.child = -1,
+		.next = -1,
+		.canon = -1,
+		.label = label,
+	};
+	return t->n++;
+}
+
+/*
+ * Adds a word to the trie.  Words arrive in order, so a new child always goes
+ * at the end of its parent's list.
+ */
+static int trie_add(struct trie *t, const char *w, uint8_t score)
+{
+	int node = 0;
+
+	for (; *w; w++) {
+		int c = t->nodes[node].child, last = -1;
+		for (; c >= 0 && t->nodes[c].label != (uint8_t) *w;
+				c = t->nodes[c].next)
+			last = c;
+		if (c < 0) {
+			if ((c = trie_node(t, *w)) < 0)
+				return 1;
+			if (last >= 0)
+				t->nodes[last].next = c;
+			else
+				t->nodes[node].child = c;
+		}
+		node = c;
+	}
+	t->nodes[node].final = 1;
+	if (score > t->nodes[node].score)
+		t->nodes[node].score = score;
+	return 0;
+}
+
+/*
+ * Hashes what a node leads to: whether it ends a word, with what score, and
+ * its children's labels and merged nodes
+ */
+static uint64_t node_hash(const struct trie *t, int node)
+{
+	const struct tnode *n = &t->nodes[node];
+	uint64_t h = 0xcbf29ce484222325ull;
+	int c;
+
+	h = (h ^ n->final) * 0x100000001b3ull;
+	h = (h ^ n->score) * 0x100000001b3ull;
+	for (c = n->child; c >= 0; c = t->nodes[c].next) {
+		h = (h ^ t->nodes[c].label) * 0x100000001b3ull;
+		h = (h ^ (uint64_t) t->nodes[c].canon) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+/*
+ * Determines whether two nodes lead to the same words
+ */
+static int node_equal(const struct trie *t, int a, int b)
+{
+	const struct tnode *na = &t->nodes[a], *nb = &t->nodes[b];
+	int ca, cb;
+
+	if (na->final != nb->final || na->score != nb->score)
+		return 0;
+	for (ca = na->child, cb = nb->child; ca >= 0 && cb >= 0;
+			ca = t->nodes[ca].next, cb = t->nodes[cb].next)
+		if (t->nodes[ca].label != t->nodes[cb].label ||
+				t->nodes[ca].canon != t->nodes[cb].canon)
+			return 0;
+	return ca < 0 && cb < 0;
+}
+
+/*
+ * Merges a node, whose children have been merged already, with an equivalent
+ * one seen before, and works out the best score below it
+ */
+static void trie_merge(struct trie *t, int node)
+{
+	struct tnode *n = &t->nodes[node];
+	int c;
+
+	n->best = n->final ? n->score : 0;
+	for (c = n->child; c >= 0; c = t->nodes[c].next)
+		if (t->nodes[c].best > n->best)
+			n->best = t->nodes[c].best;
+
+	size_t i = node_hash(t, node) & (t->tsize - 1);
+	for (; t->table[i] >= 0; i = (i + 1) & (t->tsize - 1)) {
+		if (node_equal(t, t->table[i], node)) {
+			n->canon = t->table[i];
+			return;
+		}
+	}
+	t->table[i] = node;
+	n->canon = node;
+}
+
+/*
+ * Merges the nodes below and including the given one, children first.  The
+ * trie is at most as deep as the longest word, so recursion is fine.
+ */
+static void trie_minimise(struct trie *t, int node)
+{
+	int c;
+
+	for (c = t->nodes[node].child; c >= 0; c = t->nodes[c].next)
+		trie_minimise(t, c);
+	trie_merge(t, node);
+}
+
+/*
+ * Counts a node's children
+ */
+static int node_degree(const struct trie *t, int node)
+{
+	int c, n = 0;
+
+	for (c = t->nodes[node].child; c >= 0; c = t->nodes[c].next)
+		n++;
+	return n;
+}
+
+/*
+ * Gives each distinct node with children a place in the edge array, parents
+ * first.  Returns the number of edges used.
+ */
+static uint32_t trie_place(struct trie *t, int node, uint32_t next)
+{
+	struct tnode *n = &t->nodes[node];
+	int c;
+
+	if (n->canon != node || n->pos || n->child < 0)
+		return next;
+	n->pos = next;
+	next += node_degree(t, node);
+	for (c = n->child; c >= 0; c = t->nodes[c].next)
+		next = trie_place(t, t->nodes[c].canon, next);
+	return next;
+}
+
+/*
+ * Fills in the edges of every placed node
+ */
+static void trie_emit(const struct trie *t, struct dawg_edge *edges)
+{
+	int node, c;
+
+	for (node = 0; node < t->n; node++) {
+		const struct tnode *n = &t->nodes[node];
+		if (n->canon != node || !n->pos)
+			continue;
+		uint32_t e = n->pos;
+		for (c = n->child; c >= 0; c = t->nodes[c].next, e++) {
+			const struct tnode *cn = &t->nodes[t->nodes[c].canon];
+			edges[e] = (struct dawg_edge) {
+				.child = cn->pos,
+				.label = t->nodes[c].label,
+				.flags = (cn->final ? DAWG_FINAL : 0) |
+					(t->nodes[c].next < 0 ? DAWG_LAST : 0),
+				.score = cn->score,
+				.best = cn->best,
+			};
+		}
+	}
+}
+
+/*
+ * Reads the word list.  Returns the number of words, or -1.
+ */
+static int read_words(const char *path, struct word **words, char **text)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	char *buf = NULL;
+	size_t cap = 0, len = 0;
+	int n = 0, wcap = 0, lineno = 0;
+	struct word *w = NULL;
+	char line[256];
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char *word = strtok(line, " \t\r\n");
+		if (!word || *word == '#')
+			continue;
+		char *count = strtok(NULL, " \t\r\n");
+		size_t wl = strlen(word);
+		if (wl > DAWG_MAX_WORD) {
+			fprintf(stderr, "%s:%d: word too long, skipped\n", path,
+					lineno);
+			continue;
+		}
+		if (n == wcap) {
+			wcap = wcap ? 2 * wcap : 1024;
+			struct word *nw = realloc(w, wcap * sizeof(w[0]));
+			if (!nw)
+				goto fail;
+			w = nw;
+		}
+		if (len + wl + 1 > cap) {
+			cap = cap ? 2 * cap : 65536;
+			char *nb = realloc(buf, cap);
+			if (!nb)
+				goto fail;
+			buf = nb;
+		}
+		memcpy(buf + len, word, wl + 1);
+
+		// Offsets until the text stops moving
+		w[n].text = (char *) len;
+		w[n].count = count ? atof(count) : 1;
+		if (w[n].count < 1)
+			w[n].count = 1;
+		len += wl + 1;
+		n++;
+	}
+
+	fclose(f);
+	int i;
+	for (i = 0; i < n; i++)
+		w[i].text = buf + (size_t) w[i].text;
+	*words = w;
+	*text = buf;
+	return n;
+
+fail:
+	fprintf(stderr, "Out of memory reading %s\n", path);
+	free(w);
+	free(buf);
+	fclose(f);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct trie t = {0};
+	struct word *words;
+	char *text;
+	int i, ret = 1;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s words.txt words.dawg\n", argv[0]);
+		return 1;
+	}
+
+	int n = read_words(argv[1], &words, &text);
+	if (n < 0)
+		return 1;
+	qsort(words, n, sizeof(words[0]), compare_words);
+
+	// Scores are relative to the most common word
+	double maxcount = 1;
+	for (i = 0; i < n; i++)
+		if (words[i].count > maxcount)
+			maxcount = words[i].count;
+
+	if (trie_node(&t, 0) < 0)
+		goto oom;
+	for (i = 0; i < n; i++) {
+		uint8_t score = 1 + (maxcount > 1 ? (uint8_t) (254 *
+					log(words[i].count) / log(maxcount)) : 0);
+		if (trie_add(&t, words[i].text, score))
+			goto oom;
+	}
+
+	for (t.tsize = 1; t.tsize < 2 * t.n; t.tsize *= 2)
+		;
+	t.table = malloc(t.tsize * sizeof(t.table[0]));
+	if (!t.table)
+		goto oom;
+	memset(t.table, 0xff, t.tsize * sizeof(t.table[0]));
+	trie_minimise(&t, 0);
+
+	// Edge 0 is left unused so that 0 can mean no edges
+	uint32_t nedges = trie_place(&t, 0, 1);
+	struct dawg_header hdr = {
+		.magic = DAWG_MAGIC,
+		.version = DAWG_VERSION,
+		.nedges = nedges,
+		.root = t.nodes[0].pos,
+	};
+	struct dawg_edge *edges = calloc(nedges, sizeof(edges[0]));
+	if (!edges)
+		goto oom;
+	trie_emit(&t, edges);
+
+	FILE *f = fopen(argv[2], "wb");
+	if (!f || fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+			fwrite(edges, sizeof(edges[0]), nedges, f) != nedges) {
+		perror(argv[2]);
+		if (f)
+			fclose(f);
+	} else if (fclose(f)) {
+		perror(argv[2]);
+	} else {
+		fprintf(stderr, "%d words, %d trie nodes, %u edges\n", n, t.n,
+				nedges - 1);
+		ret = 0;
+	}
+	free(edges);
+
+	goto out;
+
+oom:
+	fprintf(stderr, "Out of memory building word graph\n");
+out:
+	free(t.table);
+	free(t.nodes);
+	free(words);
+	free(text);
+	return ret;
+}
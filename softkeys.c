@@ -0,0 +1,207 @@
+/*
+ * On-screen keyboard
+ *
+ *
+ * Keys are laid out in rows of equal height, each row's keys sharing its
+ * width equally.  For hit testing, the keyboard is covered by a uniform grid
+ * with cells the size of its smallest key, so a cell overlaps only a handful
+ * of keys.  The keys of each cell are stored contiguously, so a hit test is
+ * one division per axis and a scan of a few rectangles, however many keys
+ * there are.  A touch landing on the same key as the last one doesn't even
+ * need that.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "softkeys.h"
+
+/*
+ * Determines whether a point lies on a key
+ */
+static int softkey_contains(const struct softkey *k, double x, double y)
+{
+	return x >= k->x && x < k->x + k->w && y >= k->y && y < k->y + k->h;
+}
+
+/*
+ * Splits the rows of keysym names into keys covering the given rectangle
+ */
+static int keyboard_place(struct keyboard *kb, const char *const *rows,
+		int nrows, int x, int y, int w, int h)
+{
+	size_t len = 0;
+	int i, nkeys = 0;
+
+	for (i = 0; i < nrows; i++)
+		len += strlen(rows[i]) + 1;
+	kb->names = malloc(len);
+	// No more keys than there are characters
+	kb->keys = malloc(len * sizeof(kb->keys[0]));
+	if (!kb->names || !kb->keys)
+		return 1;
+
+	char *p = kb->names;
+	for (i = 0; i < nrows; i++) {
+		strcpy(p, rows[i]);
+
+		char *names[len];
+		int n = 0;
+		char *word;
+		for (word = strtok(p, " "); word; word = strtok(NULL, " "))
+			names[n++] = word;
+		p += strlen(rows[i]) + 1;
+
+		int j;
+		int top = y + h * i / nrows;
+		int bottom = y + h * (i + 1) / nrows;
+		for (j = 0; j < n; j++) {
+			int left = x + w * j / n;
+			int right = x + w * (j + 1) / n;
+			kb->keys[nkeys++] = (struct softkey) {
+				.x = left,
+				.y = top,
+				.w = right - left,
+				.h = bottom - top,
+				.keysym = names[j],
+			};
+		}
+	}
+	kb->nkeys = nkeys;
+	return 0;
+}
+
+/*
+ * Builds the hit-testing grid over the keys
+ */
+static int keyboard_index(struct keyboard *kb, int x, int y, int w, int h)
+{
+	int i, cx, cy;
+
+	kb->x = x;
+	kb->y = y;
+	kb->w = w;
+	kb->h = h;
+	kb->cellw = w;
+	kb->cellh = h;
+	for (i = 0; i < kb->nkeys; i++) {
+		if (kb->keys[i].w > 0 && kb->keys[i].w < kb->cellw)
+			kb->cellw = kb->keys[i].w;
+		if (kb->keys[i].h > 0 && kb->keys[i].h < kb->cellh)
+			kb->cellh = kb->keys[i].h;
+	}
+	if (kb->cellw < 1)
+		kb->cellw = 1;
+	if (kb->cellh < 1)
+		kb->cellh = 1;
+	kb->cols = (w + kb->cellw - 1) / kb->cellw;
+	kb->rows = (h + kb->cellh - 1) / kb->cellh;
+
+	int ncells = kb->cols * kb->rows;
+	kb->cellstart = calloc(ncells + 1, sizeof(kb->cellstart[0]));
+	int *fill = malloc(ncells * sizeof(fill[0]));
+	if (!kb->cellstart || !fill) {
+		free(fill);
+		return 1;
+	}
+
+	// Count the keys overlapping each cell, then fill them in, so each
+	// cell's keys end up contiguous
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < kb->nkeys; i++) {
+			const struct softkey *k = &kb->keys[i];
+			if (k->w <= 0 || k->h <= 0)
+				continue;
+			int c0 = (k->x - x) / kb->cellw;
+			int c1 = (k->x + k->w - 1 - x) / kb->cellw;
+			int r0 = (k->y - y) / kb->cellh;
+			int r1 = (k->y + k->h - 1 - y) / kb->cellh;
+			for (cy = r0; cy <= r1; cy++) {
+				for (cx = c0; cx <= c1; cx++) {
+					int c = cy * kb->cols + cx;
+					if (pass)
+						kb->cellkeys[fill[c]++] = i;
+					else
+						kb->cellstart[c + 1]++;
+				}
+			}
+		}
+
+		if (pass)
+			break;
+		for (i = 0; i < ncells; i++) {
+			kb->cellstart[i + 1] += kb->cellstart[i];
+			fill[i] = kb->cellstart[i];
+		}
+		kb->cellkeys = malloc((kb->cellstart[ncells] + 1) *
+				sizeof(kb->cellkeys[0]));
+		if (!kb->cellkeys) {
+			free(fill);
+			return 1;
+		}
+	}
+
+	free(fill);
+	return 0;
+}
+
+/*
+ * Lays out a keyboard over the given rectangle from rows of space-separated
+ * keysym names, and indexes it for hit testing
+ */
+int keyboard_build(struct keyboard *kb, const char *const *rows, int nrows,
+		int x, int y, int w, int h)
+{
+	memset(kb, 0, sizeof(*kb));
+	if (keyboard_place(kb, rows, nrows, x, y, w, h) ||
+			keyboard_index(kb, x, y, w, h)) {
+		fprintf(stderr, "Failed to allocate keyboard\n");
+		keyboard_free(kb);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Frees everything allocated by keyboard_build
+ */
+void keyboard_free(struct keyboard *kb)
+{
+	free(kb->cellkeys);
+	free(kb->cellstart);
+	free(kb->keys);
+	free(kb->names);
+	memset(kb, 0, sizeof(*kb));
+}
+
+/*
+ * Returns the key under a point, or -1 if there is none.  The key last hit
+ * (-1 for none) is tried first, and updated.
+ */
+int keyboard_hit(const struct keyboard *kb, double x, double y, int *last)
+{
+	int i;
+
+	if (*last >= 0 && softkey_contains(&kb->keys[*last], x, y))
+		return *last;
+
+	if (x < kb->x || y < kb->y)
+		return -1;
+	int cx = (int) (x - kb->x) / kb->cellw;
+	int cy = (int) (y - kb->y) / kb->cellh;
+	if (cx >= kb->cols || cy >= kb->rows)
+		return -1;
+
+	int c = cy * kb->cols + cx;
+	for (i = kb->cellstart[c]; i < kb->cellstart[c + 1]; i++) {
+		if (softkey_contains(&kb->keys[kb->cellkeys[i]], x, y)) {
+			*last = kb->cellkeys[i];
+			return *last;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,33 @@
+#ifndef SOFTKEYS_H_
+#define SOFTKEYS_H_
+
+/*
+ * Key of the on-screen keyboard, in window coordinates
+ */
+struct softkey {
+	int x, y, w, h;
+	const char *keysym;
+};
+
+/*
+ * On-screen keyboard, with a uniform grid over it in which each cell lists
+ * the keys overlapping it
+ */
+struct keyboard {
+	struct softkey *keys;
+	int nkeys;
+	char *names;
+
+	int x, y, w, h;
+	int cellw, cellh;
+	int cols, rows;
+	int *cellstart;
+	int *cellkeys;
+};
+
+int keyboard_build(struct keyboard *kb, const char *const *rows, int nrows,
+		int x, int y, int w, int h);
+void keyboard_free(struct keyboard *kb);
+int keyboard_hit(const struct keyboard *kb, double x, double y, int *last);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Hierarchical timer wheel
+ *
+ *
+ * Time is divided into ticks.  Level 0 of the wheel has one slot per tick for
+ * the next TIMER_SLOTS ticks, level 1 one slot per TIMER_SLOTS ticks, and so
+ * on, each slot holding a doubly-linked list of timers, so adding or
+ * cancelling a timer is constant-time.  As the current tick crosses the start
+ * of a higher-level slot, that slot's timers are redistributed to the levels
+ * below.  Each level keeps a bitmap of its occupied slots, which lets the
+ * wheel skip over empty stretches and find the next deadline without visiting
+ * every slot.
+ *
+ * Slots only group timers; each timer keeps its exact deadline, and the
+ * timerfd is armed for the earliest one, so timers fire on time to well under
+ * a tick.  Nothing runs while no timer is due.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timers.h"
+
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_TICK_NS 1000000
+
+struct timer {
+	struct timer_event ev;
+	int next, prev;
+	int level, slot;
+};
+
+struct timers {
+	struct timer *pool;
+	int capacity;
+	int free;
+	int count;
+
+	int head[TIMER_LEVELS][TIMER_SLOTS];
+	uint64_t occupied[TIMER_LEVELS];
+	uint64_t tick;
+
+	int fd;
+	uint64_t armed;
+};
+
+struct timers *timers_create(int capacity, uint64_t now)
+{
+	struct timers *w = calloc(1, sizeof(*w));
+	int i, j;
+
+	if (!w)
+		return NULL;
+	w->pool = malloc(capacity * sizeof(w->pool[0]));
+	w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (!w->pool || w->fd < 0) {
+		if (w->fd >= 0)
+			close(w->fd);
+		free(w->pool);
+		free(w);
+		return NULL;
+	}
+
+	// Free timers are chained through next
+	w->capacity = capacity;
+	for (i = 0; i < capacity; i++) {
+		w->pool[i].next = i + 1 < capacity ? i + 1 : -1;
+		w->pool[i].level = -1;
+	}
+	w->free = capacity ? 0 : -1;
+	for (i = 0; i < TIMER_LEVELS; i++)
+		for (j = 0; j < TIMER_SLOTS; j++)
+			w->head[i][j] = -1;
+	w->tick = now / TIMER_TICK_NS;
+	return w;
+}
+
+void timers_destroy(struct timers *w)
+{
+	if (!w)
+		return;
+	close(w->fd);
+	free(w->pool);
+	free(w);
+}
+
+/*
+ * Links a timer into the slot for its deadline
+ */
+static void timers_insert(struct timers *w, int h)
+{
+	struct timer *t = &w->pool[h];
+	uint64_t tick = t->ev.when / TIMER_TICK_NS;
+	int level = 0;
+
+	if (tick < w->tick)
+		tick = w->tick;
+	uint64_t delta = tick - w->tick;
+	while (level < TIMER_LEVELS - 1 &&
+			delta >> (TIMER_BITS * (level + 1)))
+		level++;
+	// Beyond the top level: park it as far out as the wheel reaches, to
+	// be redistributed from there
+	if (delta >> (TIMER_BITS * TIMER_LEVELS))
+		tick = w->tick + ((uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+
+	t->level = level;
+	t->slot = (tick >> (TIMER_BITS * level)) & TIMER_MASK;
+	t->prev = -1;
+	t->next = w->head[level][t->slot];
+	if (t->next >= 0)
+		w->pool[t->next].prev = h;
+	w->head[level][t->slot] = h;
+	w->occupied[level] |= (uint64_t) 1 << t->slot;
+}
+
+/*
+ * Unlinks a timer from its slot
+ */
+static void timers_unlink(struct timers *w, int h)
+{
+	struct timer *t = &w->pool[h];
+
+	if (t->prev >= 0)
+		w->pool[t->prev].next = t->next;
+	else
+		w->head[t->level][t->slot] = t->next;
+	if (t->next >= 0)
+		w->pool[t->next].prev = t->prev;
+	if (w->head[t->level][t->slot] < 0)
+		w->occupied[t->level] &= ~((uint64_t) 1 << t->slot);
+}
+
+/*
+ * Returns a timer to the free list
+ */
+static void timers_release(struct timers *w, int h)
+{
+	w->pool[h].level = -1;
+	w->pool[h].next = w->free;
+	w->free = h;
+	w->count--;
+}
+
+/*
+ * Adds a timer due at the given monotonic time in nanoseconds.  Returns its
+ * handle, or -1 if there is no room.
+ */
+int timers_add(struct timers *w, uint64_t when, int kind, int deviceid,
+		uint32_t id)
+{
+	int h = w->free;
+	if (h < 0) {
+		fprintf(stderr, "Too many timers\n");
+		return -1;
+	}
+	w->free = w->pool[h].next;
+	w->count++;
+
+	w->pool[h].ev = (struct timer_event) {
+		.handle = h,
+		.kind = kind,
+		.deviceid = deviceid,
+		.id = id,
+		.when = when,
+	};
+	timers_insert(w, h);
+	return h;
+}
+
+/*
+ * Cancels a pending timer.  Handles of -1 are ignored.
+ */
+void timers_cancel(struct timers *w, int handle)
+{
+	if (handle < 0 || w->pool[handle].level < 0)
+		return;
+	timers_unlink(w, handle);
+	timers_release(w, handle);
+}
+
+/*
+ * Returns the first occupied slot of a level at or after the given one,
+ * wrapping around, or -1 if the level is empty
+ */
+static int timers_first_slot(uint64_t occupied, int start)
+{
+	uint64_t rot = start ? occupied >> start |
+		occupied << (TIMER_SLOTS - start) : occupied;
+
+	if (!rot)
+		return -1;
+	return (start + __builtin_ctzll(rot)) & TIMER_MASK;
+}
+
+/*
+ * Finds the earliest deadline of any pending timer.  Returns 0 if there are
+ * none.
+ */
+int timers_next(const struct timers *w, uint64_t *when)
+{
+	int level, h;
+	int found = 0;
+
+	// Timers may have been added to a higher level before lower levels
+	// filled up, so the first occupied slot of every level is a candidate
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		int start = (w->tick >> (TIMER_BITS * level)) & TIMER_MASK;
+		int slot = timers_first_slot(w->occupied[level],
+				level ? (start + 1) & TIMER_MASK : start);
+		if (slot < 0)
+			continue;
+		for (h = w->head[level][slot]; h >= 0; h = w->pool[h].next) {
+			if (!found || w->pool[h].ev.when < *when)
+				*when = w->pool[h].ev.when;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+/*
+ * Redistributes the higher-level slots which start at the current tick
+ */
+static void timers_cascade(struct timers *w)
+{
+	int level;
+
+	for (level = 1; level < TIMER_LEVELS; level++) {
+		int slot = (w->tick >> (TIMER_BITS * level)) & TIMER_MASK;
+		int h = w->head[level][slot];
+		w->head[level][slot] = -1;
+		w->occupied[level] &= ~((uint64_t) 1 << slot);
+		while (h >= 0) {
+			int next = w->pool[h].next;
+			timers_insert(w, h);
+			h = next;
+		}
+		if (slot)
+			break;
+	}
+}
+
+/*
+ * Advances the wheel to the given time and takes off one timer which is due
+ * by then.  Returns 0 once there are none left.
+ */
+int timers_expire(struct timers *w, uint64_t now, struct timer_event *ev)
+{
+	uint64_t target = now / TIMER_TICK_NS;
+	int h;
+
+	for (;;) {
+		for (h = w->head[0][w->tick & TIMER_MASK]; h >= 0;
+				h = w->pool[h].next) {
+			if (w->pool[h].ev.when <= now) {
+				*ev = w->pool[h].ev;
+				timers_unlink(w, h);
+				timers_release(w, h);
+				return 1;
+			}
+		}
+		if (w->tick >= target)
+			return 0;
+		if (!w->count) {
+			w->tick = target;
+			return 0;
+		}
+
+		// With nothing more on level 0, skip straight to where the
+		// next level 1 slot begins
+		uint64_t next = w->tick + 1;
+		if (!w->occupied[0])
+			next = (w->tick | TIMER_MASK) + 1;
+		if (next > target) {
+			w->tick = target;
+			return 0;
+		}
+		w->tick = next;
+		if (!(w->tick & TIMER_MASK))
+			timers_cascade(w);
+	}
+}
+
+/*
+ * Returns the timerfd which becomes readable when a timer is due
+ */
+int timers_fd(const struct timers *w)
+{
+	return w->fd;
+}
+
+/*
+ * Points the timerfd at the earliest pending deadline, or disarms it
+ */
+void timers_arm(struct timers *w)
+{
+	uint64_t when = 0;
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	uint64_t buf;
+
+	if (!timers_next(w, &when))
+		when = 0;
+	else if (!when)
+		when = 1;
+	if (when == w->armed)
+		return;
+
+	// Clear any expiry from the old setting
+	while (read(w->fd, &buf, sizeof(buf)) > 0)
+		;
+	its.it_value.tv_sec = when / 1000000000;
+	its.it_value.tv_nsec = when % 1000000000;
+	if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL))
+		perror("timerfd_settime");
+	w->armed = when;
+}
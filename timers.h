@@ -0,0 +1,31 @@
+#ifndef TIMERS_H_
+#define TIMERS_H_
+
+#include <stdint.h>
+
+/*
+ * Timer which has come due, with the key it was added under
+ */
+struct timer_event {
+	int handle;
+	int kind;
+	int deviceid;
+	uint32_t id;
+	uint64_t when;
+};
+
+struct timers;
+
+struct timers *timers_create(int capacity, uint64_t now);
+void timers_destroy(struct timers *w);
+
+int timers_add(struct timers *w, uint64_t when, int kind, int deviceid,
+		uint32_t id);
+void timers_cancel(struct timers *w, int handle);
+int timers_next(const struct timers *w, uint64_t *when);
+int timers_expire(struct timers *w, uint64_t now, struct timer_event *ev);
+
+int timers_fd(const struct timers *w);
+void timers_arm(struct timers *w);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Minimal persistent thread pool for running a batch of independent jobs
+ *
+ * The threads are created once and sleep on a condition variable between
+ * batches, so handing out a batch costs a wakeup rather than a thread
+ * creation.  The calling thread works on the batch as well.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workers.h"
+
+struct workers {
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	pthread_t *threads;
+	int nthreads;
+
+	// Current batch
+	void (*fn)(void *);
+	void **args;
+	int njobs;
+	int next;
+	int finished;
+	unsigned long generation;
+	int shutdown;
+};
+
+/*
+ * Claims and runs jobs from the current batch until none are left.  Called
+ * and returns with the lock held.
+ */
+static void workers_drain(struct workers *w)
+{
+	while (w->next < w->njobs) {
+		int job = w->next++;
+		pthread_mutex_unlock(&w->lock);
+		w->fn(w->args[job]);
+		pthread_mutex_lock(&w->lock);
+		if (++w->finished == w->njobs)
+			pthread_cond_signal(&w->done);
+	}
+}
+
+static void *workers_main(void *arg)
+{
+	struct workers *w = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->shutdown && w->generation == seen)
+			pthread_cond_wait(&w->start, &w->lock);
+		if (w->shutdown)
+			break;
+		seen = w->generation;
+		workers_drain(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/*
+ * Starts a pool with the given number of helper threads
+ */
+struct workers *workers_create(int nthreads)
+{
+	struct workers *w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->start, NULL);
+	pthread_cond_init(&w->done, NULL);
+
+	w->threads = malloc(nthreads * sizeof(w->threads[0]));
+	if (nthreads && !w->threads) {
+		workers_destroy(w);
+		return NULL;
+	}
+	for (w->nthreads = 0; w->nthreads < nthreads; w->nthreads++) {
+		if (pthread_create(&w->threads[w->nthreads], NULL,
+					workers_main, w))
+			break;
+	}
+
+	return w;
+}
+
+/*
+ * Stops and frees the pool
+ */
+void workers_destroy(struct workers *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->shutdown = 1;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	pthread_cond_destroy(&w->done);
+	pthread_cond_destroy(&w->start);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+	free(w);
+}
+
+/*
+ * Runs fn on each of the n arguments, spread across the pool and the calling
+ * thread, and returns once all of them have finished
+ */
+void workers_run(struct workers *w, void (*fn)(void *), void **args, int n)
+{
+	int i;
+
+	// Not worth waking anyone up for
+	if (n < 2 || !w || !w->nthreads) {
+		for (i = 0; i < n; i++)
+			fn(args[i]);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	w->fn = fn;
+	w->args = args;
+	w->njobs = n;
+	w->next = 0;
+	w->finished = 0;
+	w->generation++;
+	pthread_cond_broadcast(&w->start);
+
+	workers_drain(w);
+	while (w->finished < w->njobs)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
@@ -0,0 +1,11 @@
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+struct workers;
+
+struct workers *workers_create(int nthreads);
+void workers_destroy(struct workers *w);
+
+void workers_run(struct workers *w, void (*fn)(void *), void **args, int n);
+
+#endif